@@ -3,11 +3,29 @@
 
 CREATE SCHEMA rustica;
 
+-- size of the decompressed AOT image stored in rustica.modules.bin_code
+CREATE FUNCTION rustica.aot_image_size(bytea)
+    RETURNS int
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
 CREATE TABLE rustica.modules(
     name text PRIMARY KEY,
     byte_code bytea NOT NULL,
-    bin_code bytea NOT NULL,
-    heap_types int[] NOT NULL
+    -- AOT image compressed by compile_wasm(), not compressed again by TOAST
+    bin_code bytea STORAGE EXTERNAL NOT NULL,
+    heap_types int[] NOT NULL,
+    -- identify the AOT image shared by workers in the code cache
+    bin_code_hash bigint NOT NULL GENERATED ALWAYS AS (
+        ('x' || left(md5(bin_code), 16))::bit(64)::bigint
+    ) STORED,
+    bin_code_size int NOT NULL GENERATED ALWAYS AS (
+        rustica.aot_image_size(bin_code)
+    ) STORED,
+    -- bumped on every update, workers swap to the new version when it changes
+    generation bigint NOT NULL DEFAULT 1,
+    -- import module names from compile_wasm(), loaded along with this module
+    imports text[] NOT NULL DEFAULT '{}'
 );
 
 CREATE TABLE rustica.queries(
@@ -24,15 +42,38 @@ CREATE TABLE rustica.queries(
     ret_oids oid[] NOT NULL,  -- 8
     ret_field_types bigint[] NOT NULL,  -- 9
     ret_field_fn int[] NOT NULL,  -- 10
+    hot bool NOT NULL DEFAULT false,  -- 11, prepare the plan at module load
+    cache_ttl int,  -- 12, seconds to cache results of execute_returning
 
     PRIMARY KEY (module, index),
     FOREIGN KEY (module) REFERENCES rustica.modules(name)
 );
 
+-- Routes each request to a module, the most specific match wins; unmatched
+-- requests go to the "main" module.
+CREATE TABLE rustica.routes(
+    id serial PRIMARY KEY,
+    host text,  -- lowercase Host header without port, NULL matches any
+    path_prefix text NOT NULL DEFAULT '/',  -- matches whole path segments
+    port int,  -- local listener port, NULL matches any
+    module text NOT NULL,
+    priority int NOT NULL DEFAULT 0
+);
+
+-- workers cache the routes, changes reach them as relcache invalidations
+CREATE FUNCTION rustica.invalidate_routes() RETURNS TRIGGER
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C;
+
+CREATE TRIGGER route_change
+    AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON rustica.routes
+    FOR EACH STATEMENT EXECUTE FUNCTION rustica.invalidate_routes();
+
 CREATE TYPE rustica.compile_result AS (
     bin_code bytea,
     heap_types int[],
-    queries rustica.queries[]
+    queries rustica.queries[],
+    imports text[]
 );
 
 CREATE TYPE rustica.tid_oid AS (
@@ -59,3 +100,72 @@ $$ LANGUAGE plpgsql;
 CREATE TRIGGER module_change
     AFTER INSERT OR UPDATE OR DELETE ON rustica.modules
     FOR EACH ROW EXECUTE FUNCTION rustica.invalidate_module_cache();
+
+CREATE OR REPLACE FUNCTION rustica.bump_module_generation() RETURNS TRIGGER AS $$
+    BEGIN
+        NEW.generation := OLD.generation + 1;
+        RETURN NEW;
+    END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER module_generation
+    BEFORE UPDATE ON rustica.modules
+    FOR EACH ROW EXECUTE FUNCTION rustica.bump_module_generation();
+
+CREATE FUNCTION rustica.worker_stats(
+    OUT worker_id int,
+    OUT pid int,
+    OUT module_loads bigint,
+    OUT module_evictions bigint,
+    OUT modules int,
+    OUT module_bytes bigint,
+    OUT plans_total bigint,
+    OUT plans_prepared bigint
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+-- memory of each module loaded by each worker, total_bytes includes the
+-- mapped AOT image and is what counts against rustica.module_cache_size
+CREATE FUNCTION rustica.worker_module_memory(
+    OUT worker_id int,
+    OUT pid int,
+    OUT module text,
+    OUT code_bytes bigint,
+    OUT plans_bytes bigint,
+    OUT types_bytes bigint,
+    OUT total_bytes bigint
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+-- execution statistics of each query by module and index, merged from all
+-- workers and kept for the latest generation of the module only; times are
+-- in milliseconds, conv_time is spent converting arguments and rows between
+-- WASM and PG values
+CREATE FUNCTION rustica.query_stats(
+    OUT module text,
+    OUT query_index int,
+    OUT generation bigint,
+    OUT calls bigint,
+    OUT rows bigint,
+    OUT total_time float8,
+    OUT mean_time float8,
+    OUT max_time float8,
+    OUT conv_time float8,
+    OUT generic_plans bigint,
+    OUT custom_plans bigint,
+    OUT cache_hits bigint
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+CREATE FUNCTION rustica.query_stats_reset()
+    RETURNS void
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION rustica.query_stats_reset() FROM PUBLIC;
@@ -110,22 +110,17 @@ rst_bytea_out(wasm_exec_env_t exec_env, wasm_obj_t refobj) {
 
 static wasm_externref_obj_t
 rst_bytea_repeat(wasm_exec_env_t exec_env, int32_t byte, int32_t count) {
-    obj_t obj;
-    if (count <= VARATT_SHORT_MAX - VARHDRSZ_SHORT) {
-        obj = rst_obj_new(exec_env, OBJ_DATUM, NULL, count + VARHDRSZ_SHORT);
-        SET_VARSIZE_1B(DatumGetPointer(obj->body.datum),
-                       count + VARHDRSZ_SHORT);
-    }
-    else if (count <= VARATT_MAX - VARHDRSZ) {
-        obj = rst_obj_new(exec_env, OBJ_DATUM, NULL, count + VARHDRSZ);
-        SET_VARSIZE(DatumGetPointer(obj->body.datum), count + VARHDRSZ);
-    }
-    else {
+    if (count < 0 || count > VARATT_MAX - VARHDRSZ)
         ereport(ERROR, errmsg("bytea_repeat: count too large"));
-    }
-    obj->oid = BYTEAOID;
-    memset(VARDATA_ANY(DatumGetPointer(obj->body.datum)), byte, count);
-    return rst_externref_of_obj(exec_env, obj);
+    wasm_externref_obj_t rv = rst_bytea_obj_new_uninit(exec_env, count);
+    Datum bytes = wasm_externref_obj_get_datum((wasm_obj_t)rv, BYTEAOID);
+    memset(VARDATA(DatumGetPointer(bytes)), byte, count);
+    return rv;
+}
+
+static wasm_externref_obj_t
+rst_bytes_alloc_uninit(wasm_exec_env_t exec_env, int32_t len) {
+    return rst_bytea_obj_new_uninit(exec_env, len);
 }
 
 static int32_t
@@ -183,6 +178,7 @@ static NativeSymbol bytea_symbols[] = {
     { "text_encode", rst_text_encode, "(rr)r" },
     { "bytea_out", rst_bytea_out, "(r)r" },
     { "bytea_repeat", rst_bytea_repeat, "(ii)r" },
+    { "bytes_alloc_uninit", rst_bytes_alloc_uninit, "(i)r" },
     { "byteaeq", rst_byteaeq, "(rr)i" },
     { "byteaoctetlen", rst_byteaoctetlen, "(r)i" },
     { "bytea_substr", rst_bytea_substr, "(rii)r" },
@@ -0,0 +1,697 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "postgres.h"
+#include "access/detoast.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "storage/fd.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "varatt.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#include "rustica/aot_cache.h"
+#include "rustica/gucs.h"
+#include "rustica/module.h"
+
+// The registry only tells where an image lives: the owner process keeps the
+// memfd open while it has the module loaded, and other workers reopen it
+// through /proc/<owner>/fd/<fd>. When the owner goes away, the next worker
+// that misses the image publishes it again and takes over the slot.
+#define AOT_CACHE_SLOTS 64
+#define AOT_CACHE_MEMFD_PREFIX "rustica-aot-"
+
+// Images are also persisted under the data directory, so that restarted
+// workers only need to mmap() them: the page cache is shared already. The
+// image is followed by a trailer, keeping it mappable from offset 0. Files
+// only appear complete through durable_rename(), so the trailer is enough to
+// tell them apart from torn or foreign ones without reading the whole image
+// on each open.
+#define AOT_CACHE_DIR "rustica_cache"
+#define AOT_CACHE_FILE_MAGIC 0x43545352 // "RSTC"
+
+typedef struct AotFileTrailer {
+    uint32 magic;
+    uint32 size; // of the image before the trailer
+    uint64 hash; // bin_code_hash of the module
+} AotFileTrailer;
+
+// AOT images are stored in rustica.modules.bin_code behind this header and
+// compressed with LZ4 (high compression, decompression speed is the same)
+// when the build supports it; the column skips TOAST compression. Values
+// without the header are taken as plain AOT files.
+//
+// Compressed images are a stream of LZ4 blocks, each of a block size of the
+// image and prefixed with its compressed length, so that they can be
+// decompressed from slices of the TOASTed value as they are fetched instead
+// of a full copy of it. Images compressed as a single block are still read.
+#define AOT_IMAGE_MAGIC 0x5a545352 // "RSTZ"
+#define AOT_IMAGE_BLOCK_SIZE (64 * 1024)
+#define AOT_IMAGE_FETCH_SIZE (1024 * 1024)
+
+typedef enum AotImageMethod {
+    AOT_IMAGE_PLAIN = 0,
+    AOT_IMAGE_LZ4 = 1,
+    AOT_IMAGE_LZ4_BLOCKS = 2,
+} AotImageMethod;
+
+typedef struct AotImageHeader {
+    uint32 magic;
+    uint32 method;
+    uint32 size; // of the decompressed image
+} AotImageHeader;
+
+typedef struct AotCacheEntry {
+    char name[RST_MODULE_NAME_MAXLEN + 1];
+    uint64 hash;
+    uint32 size;
+    pid_t owner;
+    int fd;
+    uint64 last_used;
+} AotCacheEntry;
+
+typedef struct AotCacheShared {
+    LWLock *lock;
+    uint64 clock;
+    AotCacheEntry entries[AOT_CACHE_SLOTS];
+} AotCacheShared;
+
+static AotCacheShared *aot_cache = NULL;
+
+Size
+rst_aot_cache_shmem_size() {
+    return MAXALIGN(sizeof(AotCacheShared));
+}
+
+void
+rst_aot_cache_shmem_request() {
+    RequestAddinShmemSpace(rst_aot_cache_shmem_size());
+    RequestNamedLWLockTranche("rustica_aot_cache", 1);
+}
+
+void
+rst_aot_cache_shmem_startup() {
+    bool found;
+    aot_cache = ShmemInitStruct("rustica_aot_cache",
+                                rst_aot_cache_shmem_size(),
+                                &found);
+    if (!found) {
+        memset(aot_cache, 0, rst_aot_cache_shmem_size());
+        aot_cache->lock = &(GetNamedLWLockTranche("rustica_aot_cache"))->lock;
+    }
+}
+
+static AotCacheEntry *
+find_entry(const char *name) {
+    for (int i = 0; i < AOT_CACHE_SLOTS; i++) {
+        AotCacheEntry *entry = &aot_cache->entries[i];
+        if (entry->owner != 0 && strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static AotCacheEntry *
+find_victim() {
+    AotCacheEntry *victim = &aot_cache->entries[0];
+    for (int i = 0; i < AOT_CACHE_SLOTS; i++) {
+        AotCacheEntry *entry = &aot_cache->entries[i];
+        if (entry->owner == 0)
+            return entry;
+        if (entry->last_used < victim->last_used)
+            victim = entry;
+    }
+    return victim;
+}
+
+static void
+memfd_name(char *buf, size_t size, uint64 hash) {
+    snprintf(buf,
+             size,
+             AOT_CACHE_MEMFD_PREFIX "%016" INT64_MODIFIER "x",
+             hash);
+}
+
+static bool
+map_image(int fd, uint32 size, AotImage *image) {
+    void *addr = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        ereport(WARNING, errmsg("could not map shared AOT image: %m"));
+        return false;
+    }
+    image->addr = (uint8 *)addr;
+    image->size = size;
+    return true;
+}
+
+bool
+rst_aot_cache_attach(const char *name, uint64 hash, AotImage *image) {
+#ifdef __linux__
+    pid_t owner = 0;
+    int owner_fd = -1;
+    uint32 size = 0;
+
+    image->fd = -1;
+    if (!aot_cache)
+        return false;
+
+    LWLockAcquire(aot_cache->lock, LW_EXCLUSIVE);
+    AotCacheEntry *entry = find_entry(name);
+    if (entry && entry->hash == hash) {
+        owner = entry->owner;
+        owner_fd = entry->fd;
+        size = entry->size;
+        entry->last_used = ++aot_cache->clock;
+    }
+    LWLockRelease(aot_cache->lock);
+    if (owner == 0 || owner == MyProcPid)
+        return false;
+
+    // The owner may have closed the memfd and reused the fd number since, so
+    // make sure it still points to the expected image before mapping it.
+    char path[MAXPGPATH];
+    char link[MAXPGPATH];
+    char expected[64];
+    snprintf(path, MAXPGPATH, "/proc/%d/fd/%d", (int)owner, owner_fd);
+    ssize_t len = readlink(path, link, MAXPGPATH - 1);
+    if (len < 0)
+        return false;
+    link[len] = '\0';
+    memfd_name(expected, sizeof(expected), hash);
+    if (strncmp(link, "/memfd:", 7) != 0
+        || strncmp(link + 7, expected, strlen(expected)) != 0)
+        return false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool rv = fstat(fd, &st) == 0 && st.st_size == size
+              && map_image(fd, size, image);
+    close(fd);
+    return rv;
+#else
+    return false;
+#endif
+}
+
+bool
+rst_aot_cache_publish(const char *name,
+                      uint64 hash,
+                      const uint8 *data,
+                      uint32 size,
+                      AotImage *image) {
+#ifdef __linux__
+    char fd_name[64];
+
+    image->fd = -1;
+    if (!aot_cache)
+        return false;
+
+    memfd_name(fd_name, sizeof(fd_name), hash);
+    int fd = memfd_create(fd_name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        ereport(WARNING, errmsg("could not create memfd: %m"));
+        return false;
+    }
+    for (uint32 written = 0; written < size;) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ereport(WARNING, errmsg("could not write memfd: %m"));
+            close(fd);
+            return false;
+        }
+        written += n;
+    }
+    if (fcntl(fd,
+              F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+            < 0
+        || !map_image(fd, size, image)) {
+        close(fd);
+        return false;
+    }
+    image->fd = fd;
+
+    LWLockAcquire(aot_cache->lock, LW_EXCLUSIVE);
+    AotCacheEntry *entry = find_entry(name);
+    if (!entry)
+        entry = find_victim();
+    strlcpy(entry->name, name, sizeof(entry->name));
+    entry->hash = hash;
+    entry->size = size;
+    entry->owner = MyProcPid;
+    entry->fd = fd;
+    entry->last_used = ++aot_cache->clock;
+    LWLockRelease(aot_cache->lock);
+    return true;
+#else
+    image->fd = -1;
+    return false;
+#endif
+}
+
+static void
+cache_file_path(char *buf, uint64 hash) {
+    snprintf(buf,
+             MAXPGPATH,
+             AOT_CACHE_DIR "/%016" INT64_MODIFIER "x.aot",
+             hash);
+}
+
+bool
+rst_aot_cache_open_file(uint64 hash, uint32 size, AotImage *image) {
+    char path[MAXPGPATH];
+    struct stat st;
+    AotFileTrailer trailer;
+
+    image->fd = -1;
+    if (!rst_aot_disk_cache)
+        return false;
+
+    cache_file_path(path, hash);
+    int fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            ereport(WARNING,
+                    errcode_for_file_access(),
+                    errmsg("could not open file \"%s\": %m", path));
+        return false;
+    }
+
+    // A torn or foreign file is just ignored, and the caller overwrites it
+    // from the table.
+    bool rv = fstat(fd, &st) == 0 && st.st_size == size + sizeof(trailer)
+              && pg_pread(fd, &trailer, sizeof(trailer), size)
+                     == sizeof(trailer)
+              && trailer.magic == AOT_CACHE_FILE_MAGIC && trailer.size == size
+              && trailer.hash == hash && map_image(fd, size, image);
+    CloseTransientFile(fd);
+    return rv;
+}
+
+static bool
+write_all(int fd, const char *path, const void *data, uint32 size) {
+    for (uint32 written = 0; written < size;) {
+        ssize_t n = write(fd, (const char *)data + written, size - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ereport(WARNING,
+                    errcode_for_file_access(),
+                    errmsg("could not write file \"%s\": %m", path));
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+bool
+rst_aot_cache_write_file(uint64 hash, const uint8 *data, uint32 size) {
+    char path[MAXPGPATH];
+    char tmp_path[MAXPGPATH];
+
+    if (!rst_aot_disk_cache)
+        return false;
+
+    if (MakePGDirectory(AOT_CACHE_DIR) < 0 && errno != EEXIST) {
+        ereport(WARNING,
+                errcode_for_file_access(),
+                errmsg("could not create directory \"%s\": %m",
+                       AOT_CACHE_DIR));
+        return false;
+    }
+    cache_file_path(path, hash);
+    snprintf(tmp_path, MAXPGPATH, "%s.tmp.%d", path, MyProcPid);
+
+    int fd =
+        OpenTransientFile(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+    if (fd < 0) {
+        ereport(WARNING,
+                errcode_for_file_access(),
+                errmsg("could not create file \"%s\": %m", tmp_path));
+        return false;
+    }
+    AotFileTrailer trailer = { .magic = AOT_CACHE_FILE_MAGIC,
+                               .size = size,
+                               .hash = hash };
+    if (!write_all(fd, tmp_path, data, size)
+        || !write_all(fd, tmp_path, &trailer, sizeof(trailer))) {
+        CloseTransientFile(fd);
+        unlink(tmp_path);
+        return false;
+    }
+    CloseTransientFile(fd);
+
+    // Concurrent writers of the same image race harmlessly on the rename
+    if (durable_rename(tmp_path, path, WARNING) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+// Removes cached images no longer referenced by rustica.modules, and
+// temporary files left behind by writers that are gone. The directory is
+// listed before the table is read with a new snapshot, so that an image
+// written meanwhile for a new module version is never taken as stale.
+// Must be called in a transaction with SPI connected.
+void
+rst_aot_cache_sweep_files() {
+    DIR *dir;
+    struct dirent *de;
+    List *files = NIL;
+    ListCell *lc;
+    int removed = 0;
+
+    if (!rst_aot_disk_cache)
+        return;
+    dir = AllocateDir(AOT_CACHE_DIR);
+    if (dir == NULL) {
+        if (errno != ENOENT)
+            ereport(WARNING,
+                    errcode_for_file_access(),
+                    errmsg("could not open directory \"%s\": %m",
+                           AOT_CACHE_DIR));
+        return;
+    }
+    while ((de = ReadDir(dir, AOT_CACHE_DIR)) != NULL) {
+        uint64 hash;
+        int pid, len;
+        if (sscanf(de->d_name,
+                   "%16" INT64_MODIFIER "x.aot.tmp.%d%n",
+                   &hash,
+                   &pid,
+                   &len)
+                == 2
+            && de->d_name[len] == '\0') {
+            if (kill(pid, 0) < 0 && errno == ESRCH)
+                files = lappend(files, pstrdup(de->d_name));
+        }
+        else if (strlen(de->d_name) == 20
+                 && strcmp(de->d_name + 16, ".aot") == 0)
+            files = lappend(files, pstrdup(de->d_name));
+    }
+    FreeDir(dir);
+    if (files == NIL)
+        return;
+
+    int ret =
+        SPI_execute("SELECT bin_code_hash FROM rustica.modules", false, 0);
+    if (ret != SPI_OK_SELECT) {
+        ereport(WARNING,
+                errmsg("could not list module hashes: %s",
+                       SPI_result_code_string(ret)));
+        list_free_deep(files);
+        return;
+    }
+    foreach (lc, files) {
+        char *file = lfirst(lc);
+        char path[MAXPGPATH];
+        bool referenced = false;
+        if (strstr(file, ".tmp.") == NULL) {
+            uint64 hash = strtou64(file, NULL, 16);
+            for (uint64 i = 0; i < SPI_processed && !referenced; i++) {
+                bool isnull;
+                Datum datum = SPI_getbinval(SPI_tuptable->vals[i],
+                                            SPI_tuptable->tupdesc,
+                                            1,
+                                            &isnull);
+                referenced = (uint64)DatumGetInt64(datum) == hash;
+            }
+        }
+        if (referenced)
+            continue;
+        snprintf(path, MAXPGPATH, AOT_CACHE_DIR "/%s", file);
+        if (unlink(path) < 0 && errno != ENOENT)
+            ereport(WARNING,
+                    errcode_for_file_access(),
+                    errmsg("could not remove file \"%s\": %m", path));
+        else
+            removed++;
+    }
+    SPI_freetuptable(SPI_tuptable);
+    list_free_deep(files);
+    if (removed > 0)
+        ereport(DEBUG1,
+                errmsg("removed %d stale files from \"%s\"",
+                       removed,
+                       AOT_CACHE_DIR));
+}
+
+void
+rst_aot_cache_release(AotImage *image) {
+    if (!image->addr)
+        return;
+    munmap(image->addr, image->size);
+    image->addr = NULL;
+    if (image->fd < 0)
+        return;
+
+    // Withdraw our slot as other workers can no longer open the memfd
+    LWLockAcquire(aot_cache->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < AOT_CACHE_SLOTS; i++) {
+        AotCacheEntry *entry = &aot_cache->entries[i];
+        if (entry->owner == MyProcPid && entry->fd == image->fd)
+            entry->owner = 0;
+    }
+    LWLockRelease(aot_cache->lock);
+    close(image->fd);
+    image->fd = -1;
+}
+
+bytea *
+rst_aot_image_pack(const uint8 *data, uint32 size) {
+    AotImageHeader header = { .magic = AOT_IMAGE_MAGIC,
+                              .method = AOT_IMAGE_PLAIN,
+                              .size = size };
+    bytea *rv;
+
+#ifdef USE_LZ4
+    uint32 nblocks = (size + AOT_IMAGE_BLOCK_SIZE - 1) / AOT_IMAGE_BLOCK_SIZE;
+    int block_bound = LZ4_compressBound(AOT_IMAGE_BLOCK_SIZE);
+    rv = (bytea *)palloc(VARHDRSZ + sizeof(header)
+                         + (Size)nblocks * (sizeof(uint32) + block_bound));
+    char *out = VARDATA(rv) + sizeof(header);
+
+    // Blocks are compressed as a stream, so that each one can still refer
+    // to the data of the blocks before it
+    LZ4_streamHC_t *stream = LZ4_createStreamHC();
+    if (!stream)
+        ereport(ERROR, errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory"));
+    LZ4_resetStreamHC_fast(stream, LZ4HC_CLEVEL_DEFAULT);
+    uint32 len = 0;
+    for (uint32 offset = 0; offset < size; offset += AOT_IMAGE_BLOCK_SIZE) {
+        int n = LZ4_compress_HC_continue(
+            stream,
+            (const char *)data + offset,
+            out + len + sizeof(uint32),
+            (int)Min(AOT_IMAGE_BLOCK_SIZE, size - offset),
+            block_bound);
+        if (n <= 0) {
+            len = size;
+            break;
+        }
+        uint32 block_len = (uint32)n;
+        memcpy(out + len, &block_len, sizeof(uint32));
+        len += sizeof(uint32) + block_len;
+    }
+    LZ4_freeStreamHC(stream);
+    if (len < size) {
+        header.method = AOT_IMAGE_LZ4_BLOCKS;
+        memcpy(VARDATA(rv), &header, sizeof(header));
+        SET_VARSIZE(rv, VARHDRSZ + sizeof(header) + len);
+        ereport(DEBUG1,
+                errmsg("compressed AOT image: %u -> %u bytes (%.1f%%)",
+                       size,
+                       len,
+                       100.0 * len / size));
+        return rv;
+    }
+    pfree(rv);
+#endif
+
+    rv = (bytea *)palloc(VARHDRSZ + sizeof(header) + size);
+    memcpy(VARDATA(rv), &header, sizeof(header));
+    memcpy(VARDATA(rv) + sizeof(header), data, size);
+    SET_VARSIZE(rv, VARHDRSZ + sizeof(header) + size);
+    return rv;
+}
+
+static bool
+read_image_header(const char *data, uint32 len, AotImageHeader *header) {
+    if (len < sizeof(AotImageHeader))
+        return false;
+    memcpy(header, data, sizeof(AotImageHeader));
+    return header->magic == AOT_IMAGE_MAGIC;
+}
+
+#ifdef USE_LZ4
+// Decompresses a stream of blocks, fetching the stored value a slice at a
+// time; returns NULL if it's corrupted.
+static uint8 *
+unpack_lz4_blocks(struct varlena *attr, uint32 len, uint32 size) {
+    uint8 *rv = (uint8 *)palloc(size);
+    LZ4_streamDecode_t stream;
+    LZ4_setStreamDecode(&stream, NULL, 0);
+    uint32 in = sizeof(AotImageHeader);
+    uint32 out = 0;
+
+    while (in < len) {
+        struct varlena *slice =
+            detoast_attr_slice(attr, in, Min(AOT_IMAGE_FETCH_SIZE, len - in));
+        const char *data = VARDATA_ANY(slice);
+        uint32 avail = VARSIZE_ANY_EXHDR(slice);
+        uint32 pos = 0;
+        while (pos + sizeof(uint32) <= avail) {
+            uint32 block_len;
+            memcpy(&block_len, data + pos, sizeof(uint32));
+            if (block_len > avail - pos - sizeof(uint32))
+                break; // continued in the next slice
+            uint32 expected = Min(AOT_IMAGE_BLOCK_SIZE, size - out);
+            int n = LZ4_decompress_safe_continue(&stream,
+                                                 data + pos + sizeof(uint32),
+                                                 (char *)rv + out,
+                                                 (int)block_len,
+                                                 (int)expected);
+            if (n < 0 || (uint32)n != expected) {
+                pos = 0;
+                break;
+            }
+            out += expected;
+            pos += sizeof(uint32) + block_len;
+        }
+        pfree(slice);
+        if (pos == 0)
+            break; // corrupted, or a block larger than a slice
+        in += pos;
+    }
+    if (in != len || out != size) {
+        pfree(rv);
+        return NULL;
+    }
+    return rv;
+}
+#endif
+
+// Returns the AOT file in the stored value, or a palloc'd buffer with the
+// decompressed one that can be handed to the loader directly. Compressed
+// images are decompressed without detoasting the whole value first.
+uint8 *
+rst_aot_image_unpack(const char *name, Datum datum, uint32 *size) {
+    struct varlena *attr = (struct varlena *)DatumGetPointer(datum);
+    AotImageHeader header;
+
+    struct varlena *head = detoast_attr_slice(attr, 0, sizeof(header));
+    bool has_header = read_image_header(VARDATA_ANY(head),
+                                        VARSIZE_ANY_EXHDR(head),
+                                        &header);
+    pfree(head);
+    if (has_header && header.method == AOT_IMAGE_LZ4_BLOCKS) {
+#ifdef USE_LZ4
+        instr_time start, duration;
+        INSTR_TIME_SET_CURRENT(start);
+        uint32 len = toast_raw_datum_size(datum) - VARHDRSZ;
+        uint8 *rv = unpack_lz4_blocks(attr, len, header.size);
+        if (!rv)
+            ereport(ERROR,
+                    errcode(ERRCODE_DATA_CORRUPTED),
+                    errmsg("invalid AOT image of module \"%s\"", name));
+        INSTR_TIME_SET_CURRENT(duration);
+        INSTR_TIME_SUBTRACT(duration, start);
+        ereport(DEBUG1,
+                errmsg("decompressed AOT image of module \"%s\": %u -> %u "
+                       "bytes (%.1f%%) in %.3f ms",
+                       name,
+                       len,
+                       header.size,
+                       100.0 * len / header.size,
+                       INSTR_TIME_GET_MILLISEC(duration)));
+        *size = header.size;
+        return rv;
+#else
+        ereport(ERROR,
+                errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("AOT image of module \"%s\" is compressed with "
+                       "LZ4, which is not supported by this build",
+                       name));
+#endif
+    }
+
+    // Plain images are handed to the loader as a whole anyway
+    bytea *image = DatumGetByteaPP(datum);
+    const char *data = VARDATA_ANY(image);
+    uint32 len = VARSIZE_ANY_EXHDR(image);
+    if (!has_header) {
+        *size = len;
+        return (uint8 *)data;
+    }
+    data += sizeof(header);
+    len -= sizeof(header);
+
+    switch ((AotImageMethod)header.method) {
+        case AOT_IMAGE_PLAIN:
+            if (len != header.size)
+                break;
+            *size = len;
+            return (uint8 *)data;
+
+        case AOT_IMAGE_LZ4: {
+#ifdef USE_LZ4
+            uint8 *rv = (uint8 *)palloc(header.size);
+            int n = LZ4_decompress_safe(data,
+                                        (char *)rv,
+                                        (int)len,
+                                        (int)header.size);
+            if (n < 0 || (uint32)n != header.size) {
+                pfree(rv);
+                break;
+            }
+            *size = header.size;
+            return rv;
+#else
+            ereport(ERROR,
+                    errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("AOT image of module \"%s\" is compressed with "
+                           "LZ4, which is not supported by this build",
+                           name));
+#endif
+        }
+
+        case AOT_IMAGE_LZ4_BLOCKS:
+            break;
+    }
+    ereport(ERROR,
+            errcode(ERRCODE_DATA_CORRUPTED),
+            errmsg("invalid AOT image of module \"%s\"", name));
+    pg_unreachable();
+}
+
+// Size of the decompressed image, only the header is fetched
+Datum
+rst_aot_image_size(PG_FUNCTION_ARGS) {
+    AotImageHeader header;
+    bytea *image = PG_GETARG_BYTEA_P_SLICE(0, 0, sizeof(header));
+    if (read_image_header(VARDATA_ANY(image),
+                          VARSIZE_ANY_EXHDR(image),
+                          &header))
+        PG_RETURN_INT32((int32)header.size);
+    PG_RETURN_INT32((int32)toast_raw_datum_size(PG_GETARG_DATUM(0))
+                    - VARHDRSZ);
+}
@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#ifndef RUSTICA_AOT_CACHE_H
+#define RUSTICA_AOT_CACHE_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+// An AOT image mapped read-only and executable from a sealed memfd that is
+// shared by all workers running the same (module, bin_code hash).
+typedef struct AotImage {
+    uint8 *addr;
+    uint32 size;
+    int fd; // memfd published by this process, -1 if attached from another
+} AotImage;
+
+Size
+rst_aot_cache_shmem_size();
+
+void
+rst_aot_cache_shmem_request();
+
+void
+rst_aot_cache_shmem_startup();
+
+bool
+rst_aot_cache_attach(const char *name, uint64 hash, AotImage *image);
+
+bool
+rst_aot_cache_publish(const char *name,
+                      uint64 hash,
+                      const uint8 *data,
+                      uint32 size,
+                      AotImage *image);
+
+bool
+rst_aot_cache_open_file(uint64 hash, uint32 size, AotImage *image);
+
+bool
+rst_aot_cache_write_file(uint64 hash, const uint8 *data, uint32 size);
+
+void
+rst_aot_cache_sweep_files();
+
+void
+rst_aot_cache_release(AotImage *image);
+
+bytea *
+rst_aot_image_pack(const uint8 *data, uint32 size);
+
+uint8 *
+rst_aot_image_unpack(const char *name, Datum datum, uint32 *size);
+
+Datum rst_aot_image_size(PG_FUNCTION_ARGS);
+
+#endif /* RUSTICA_AOT_CACHE_H */
@@ -8,6 +8,7 @@
 #include "tcop/tcopprot.h"
 #include "tcop/pquery.h"
 #include "utils/array.h"
+#include "utils/builtins.h"
 #include "utils/lsyscache.h"
 #include "utils/typcache.h"
 #include "varatt.h"
@@ -20,8 +21,10 @@
 #include "dwarf_extractor.h"
 #endif
 
+#include "rustica/aot_cache.h"
 #include "rustica/compiler.h"
 #include "rustica/datatypes.h"
+#include "rustica/gucs.h"
 #include "rustica/utils.h"
 #include "rustica/wamr.h"
 
@@ -34,6 +37,12 @@ typedef enum wasm_to_pg_fn {
     wasm_externref_to_datum_obj,
     wasm_i32_array_to_pg_int2_array,
     wasm_i32_array_to_pg_int4_array,
+    wasm_i64_array_to_pg_int8_array,
+    wasm_f64_array_to_pg_float8_array,
+    wasm_i32_array_to_pg_bool_array,
+    wasm_externref_array_to_pg_text_array,
+    wasm_externref_array_to_pg_uuid_array,
+    wasm_externref_array_to_pg_bytea_array,
 } wasm_to_pg_fn;
 
 typedef enum pg_to_wasm_fn {
@@ -45,6 +54,12 @@ typedef enum pg_to_wasm_fn {
     pg_datum_to_wasm_obj,
     pg_int2_array_to_wasm_i32_array,
     pg_int4_array_to_wasm_i32_array,
+    pg_int8_array_to_wasm_i64_array,
+    pg_float8_array_to_wasm_f64_array,
+    pg_bool_array_to_wasm_i32_array,
+    pg_text_array_to_wasm_externref_array,
+    pg_uuid_array_to_wasm_externref_array,
+    pg_bytea_array_to_wasm_externref_array,
 } pg_to_wasm_fn;
 
 static Datum
@@ -66,6 +81,9 @@ compile_queries(CommonHeapTypes *heap_types,
                 wasm_func_type_t func_type,
                 wasm_module_t module);
 
+static Datum
+collect_imports(wasm_module_t module);
+
 static void
 compile_query_type(wasm_module_t module,
                    wasm_ref_type_t ref_type,
@@ -115,6 +133,8 @@ compile_aot(
                              .enable_bulk_memory = true,
                              .enable_aux_stack_frame = true,
                              .enable_gc = true,
+                             .is_indirect_mode = rst_compile_xip,
+                             .disable_llvm_intrinsics = rst_compile_xip,
                              .target_arch = "x86_64" };
     aot_comp_data_t comp_data =
         aot_create_comp_data(module, option.target_arch, option.enable_gc);
@@ -161,16 +181,17 @@ compile_aot(
             errmsg("could not create object data: %s", aot_get_last_error()));
     uint32_t aot_file_size =
         aot_get_aot_file_size(comp_ctx, comp_data, obj_data);
-    bytea *rv = (bytea *)palloc(aot_file_size + VARHDRSZ);
-    SET_VARSIZE(rv, aot_file_size + VARHDRSZ);
+    uint8 *aot_file = (uint8 *)palloc(aot_file_size);
     if (!aot_emit_aot_file_buf_ex(comp_ctx,
                                   comp_data,
                                   obj_data,
-                                  (uint8 *)VARDATA(rv),
+                                  aot_file,
                                   aot_file_size))
         ereport(ERROR,
                 errmsg("Failed to emit aot file: %s", aot_get_last_error()));
     aot_obj_data_destroy(obj_data);
+    bytea *rv = rst_aot_image_pack(aot_file, aot_file_size);
+    pfree(aot_file);
     PG_RETURN_POINTER(rv);
 }
 
@@ -206,7 +227,7 @@ rst_compile(PG_FUNCTION_ARGS) {
     }
 
     TupleDesc rv_tupdesc;
-    Datum rv[3] = { 0 };
+    Datum rv[4] = { 0 };
     wasm_module_t module = NULL;
 
     // The backdoor API may create nested WAMR runtime, so stash the parent env
@@ -227,13 +248,15 @@ rst_compile(PG_FUNCTION_ARGS) {
 #endif
             get_call_result_type(fcinfo, NULL, &rv_tupdesc);
         Assert(rv_cls == TYPEFUNC_COMPOSITE);
-        Assert(rv_tupdesc->natts == 3);
+        Assert(rv_tupdesc->natts == 4);
         Assert(TupleDescAttr(rv_tupdesc, 0)->atttypid == BYTEAOID);
         Assert(get_element_type(TupleDescAttr(rv_tupdesc, 1)->atttypid)
                == INT4OID);
         Oid query_oid =
             get_element_type(TupleDescAttr(rv_tupdesc, 2)->atttypid);
         Assert(query_oid != InvalidOid);
+        Assert(get_element_type(TupleDescAttr(rv_tupdesc, 3)->atttypid)
+               == TEXTOID);
 
         // Compile AOT binary and query plans
         rv[0] = compile_aot(
@@ -242,6 +265,7 @@ rst_compile(PG_FUNCTION_ARGS) {
 #endif
             module);
         run_and_compile(module, query_oid, &rv[1], &rv[2]);
+        rv[3] = collect_imports(module);
     }
     PG_FINALLY();
     {
@@ -254,7 +278,7 @@ rst_compile(PG_FUNCTION_ARGS) {
     }
     PG_END_TRY();
 
-    bool isnull[3] = { 0 };
+    bool isnull[4] = { 0 };
     // If no queries are found, mark the 3rd field (queries) as NULL
     if (!rv[2])
         isnull[2] = 1;
@@ -294,6 +318,30 @@ run_and_compile(wasm_module_t module,
                                                          'i'));
 }
 
+// List the distinct module names this module imports from, so that the
+// worker can fetch the whole dependency closure in one round-trip. Names of
+// host natives like "env" are kept too, they just don't match any module.
+static Datum
+collect_imports(wasm_module_t module) {
+    int32 count = wasm_runtime_get_import_count(module);
+    const char **module_names = palloc(sizeof(char *) * Max(count, 1));
+    Datum *names = palloc(sizeof(Datum) * Max(count, 1));
+    int nnames = 0;
+    for (int32 i = 0; i < count; i++) {
+        wasm_import_t import;
+        wasm_runtime_get_import_type(module, i, &import);
+        bool seen = false;
+        for (int j = 0; j < nnames && !seen; j++)
+            seen = strcmp(module_names[j], import.module_name) == 0;
+        if (seen)
+            continue;
+        module_names[nnames] = import.module_name;
+        names[nnames++] = CStringGetTextDatum(import.module_name);
+    }
+    pfree(module_names);
+    return PointerGetDatum(construct_array_builtin(names, nnames, TEXTOID));
+}
+
 static Datum
 compile_queries(CommonHeapTypes *heap_types,
                 Oid query_oid,
@@ -357,7 +405,7 @@ compile_queries(CommonHeapTypes *heap_types,
         // Compile each query
         query_tupdesc = lookup_rowtype_tupdesc(query_oid, -1);
         for (uint32 q = 0; q < nqueries; q++) {
-            Datum query_attrs[12];
+            Datum query_attrs[13];
 
             // Compile the query type first
             wasm_ref_type_t query_ref_type =
@@ -377,8 +425,12 @@ compile_queries(CommonHeapTypes *heap_types,
                           query_ref_type,
                           query);
 
-            // Construct a query tuple
+            // Construct a query tuple, plans are prepared lazily by default
+            // and results are not cached
+            query_attrs[11] = BoolGetDatum(false);
+            query_attrs[12] = (Datum)0;
             bool isnull[sizeof(query_attrs) / sizeof(Datum)] = { false };
+            isnull[12] = true;
             queries_array[q] = HeapTupleGetDatum(
                 heap_form_tuple(query_tupdesc, query_attrs, isnull));
         }
@@ -754,6 +806,44 @@ wasm_to_pg(wasm_exec_env_t exec_env,
                                : wasm_i32_array_to_pg_int4_array;
             break;
 
+        case INT8ARRAYOID:
+        case FLOAT8ARRAYOID:
+        case BOOLARRAYOID:
+            if (validate_moonbit_array(ref_type,
+                                       wasm_exec_env_get_module(exec_env),
+                                       &ref_type,
+                                       NULL,
+                                       false)) {
+                if (pg_type == INT8ARRAYOID
+                    && ref_type.value_type == VALUE_TYPE_I64)
+                    return wasm_i64_array_to_pg_int8_array;
+                if (pg_type == FLOAT8ARRAYOID
+                    && ref_type.value_type == VALUE_TYPE_F64)
+                    return wasm_f64_array_to_pg_float8_array;
+                if (pg_type == BOOLARRAYOID
+                    && ref_type.value_type == VALUE_TYPE_I32)
+                    return wasm_i32_array_to_pg_bool_array;
+            }
+            break;
+
+        case TEXTARRAYOID:
+        case UUIDARRAYOID:
+        case BYTEAARRAYOID:
+            if (validate_moonbit_array(ref_type,
+                                       wasm_exec_env_get_module(exec_env),
+                                       &ref_type,
+                                       NULL,
+                                       false)
+                && (wasm_is_reftype_externref(ref_type.value_type)
+                    || ref_type.heap_type == HEAP_TYPE_EXTERN)) {
+                if (pg_type == TEXTARRAYOID)
+                    return wasm_externref_array_to_pg_text_array;
+                if (pg_type == UUIDARRAYOID)
+                    return wasm_externref_array_to_pg_uuid_array;
+                return wasm_externref_array_to_pg_bytea_array;
+            }
+            break;
+
         default:
             break;
     }
@@ -823,6 +913,44 @@ pg_to_wasm(wasm_exec_env_t exec_env,
                                : pg_int4_array_to_wasm_i32_array;
             break;
 
+        case INT8ARRAYOID:
+        case FLOAT8ARRAYOID:
+        case BOOLARRAYOID:
+            if (validate_moonbit_array(ref_type,
+                                       wasm_exec_env_get_module(exec_env),
+                                       &ref_type,
+                                       NULL,
+                                       false)) {
+                if (pg_type == INT8ARRAYOID
+                    && ref_type.value_type == VALUE_TYPE_I64)
+                    return pg_int8_array_to_wasm_i64_array;
+                if (pg_type == FLOAT8ARRAYOID
+                    && ref_type.value_type == VALUE_TYPE_F64)
+                    return pg_float8_array_to_wasm_f64_array;
+                if (pg_type == BOOLARRAYOID
+                    && ref_type.value_type == VALUE_TYPE_I32)
+                    return pg_bool_array_to_wasm_i32_array;
+            }
+            break;
+
+        case TEXTARRAYOID:
+        case UUIDARRAYOID:
+        case BYTEAARRAYOID:
+            if (validate_moonbit_array(ref_type,
+                                       wasm_exec_env_get_module(exec_env),
+                                       &ref_type,
+                                       NULL,
+                                       false)
+                && (wasm_is_reftype_externref(ref_type.value_type)
+                    || ref_type.heap_type == HEAP_TYPE_EXTERN)) {
+                if (pg_type == TEXTARRAYOID)
+                    return pg_text_array_to_wasm_externref_array;
+                if (pg_type == UUIDARRAYOID)
+                    return pg_uuid_array_to_wasm_externref_array;
+                return pg_bytea_array_to_wasm_externref_array;
+            }
+            break;
+
         default:
             break;
     }
@@ -0,0 +1,389 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#include "postgres.h"
+#include "access/sysattr.h"
+#include "access/table.h"
+#include "access/xact.h"
+#include "commands/copy.h"
+#include "commands/defrem.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "parser/parse_node.h"
+#include "parser/parse_relation.h"
+#include "parser/parser.h"
+#include "port/pg_bswap.h"
+#include "tcop/utility.h"
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+
+#include "wasm_runtime_common.h"
+
+#include "rustica/copy.h"
+#include "rustica/datatypes.h"
+#include "rustica/result_cache.h"
+
+// Buffered input is loaded once this much of it forms complete records
+#define COPY_BATCH_SIZE (1024 * 1024)
+
+#define BINARY_SIGNATURE_LEN 11
+#define BINARY_HEADER_MIN_LEN (BINARY_SIGNATURE_LEN + 8)
+
+typedef enum CopyIngestFormat {
+    INGEST_TEXT,
+    INGEST_CSV,
+    INGEST_BINARY,
+} CopyIngestFormat;
+
+// A COPY ... FROM STDIN fed by the guest chunk by chunk. CopyFrom() pulls its
+// input to the end, so the input is buffered and loaded in batches of whole
+// records, each batch being one BeginCopyFrom()/CopyFrom() run over the same
+// relation in the current transaction.
+struct CopyIngest {
+    Oid relid;
+    List *attnamelist;
+    List *options;      // for the first batch
+    List *next_options; // without HEADER, for the following batches
+    CopyIngestFormat format;
+    char quote;
+    char escape;
+
+    StringInfoData buf;
+    int scan_pos; // bytes of buf scanned for record boundaries
+    int boundary; // end of the last complete record in buf
+    bool in_quote;
+    bool escaped;
+    bool scan_done;  // binary trailer seen, the rest goes to the last batch
+    int header_len;  // binary file header, repeated for following batches
+    char *header;
+
+    int batches;
+    uint64 rows;
+    bool finished;
+};
+
+// Input of the running batch, as CopyFrom()'s data source has no argument
+static struct {
+    const char *data[2];
+    int len[2];
+    int part;
+    int pos;
+} copy_source;
+
+static int
+copy_source_read(void *outbuf, int minread, int maxread) {
+    int copied = 0;
+    while (copied < maxread && copy_source.part < 2) {
+        int part = copy_source.part;
+        int n = Min(copy_source.len[part] - copy_source.pos, maxread - copied);
+        memcpy((char *)outbuf + copied,
+               copy_source.data[part] + copy_source.pos,
+               n);
+        copied += n;
+        copy_source.pos += n;
+        if (copy_source.pos == copy_source.len[part]) {
+            copy_source.part++;
+            copy_source.pos = 0;
+        }
+    }
+    return copied;
+}
+
+static void
+scan_text(CopyIngest *ci) {
+    StringInfo buf = &ci->buf;
+    for (int i = ci->scan_pos; i < buf->len; i++) {
+        char c = buf->data[i];
+        if (ci->escaped)
+            ci->escaped = false;
+        else if (c == '\\')
+            ci->escaped = true;
+        else if (c == '\n')
+            ci->boundary = i + 1;
+    }
+    ci->scan_pos = buf->len;
+}
+
+static void
+scan_csv(CopyIngest *ci) {
+    StringInfo buf = &ci->buf;
+    for (int i = ci->scan_pos; i < buf->len; i++) {
+        char c = buf->data[i];
+        if (ci->escaped)
+            ci->escaped = false;
+        else if (ci->in_quote && c == ci->escape && ci->escape != ci->quote)
+            ci->escaped = true;
+        else if (c == ci->quote)
+            ci->in_quote = !ci->in_quote;
+        else if (c == '\n' && !ci->in_quote)
+            ci->boundary = i + 1;
+    }
+    ci->scan_pos = buf->len;
+}
+
+static void
+scan_binary(CopyIngest *ci) {
+    StringInfo buf = &ci->buf;
+    if (ci->batches == 0 && ci->scan_pos == 0) {
+        // Skip the file header, keeping a copy for the following batches
+        if (buf->len < BINARY_HEADER_MIN_LEN)
+            return;
+        uint32 ext_len;
+        memcpy(&ext_len, buf->data + BINARY_SIGNATURE_LEN + 4, 4);
+        ext_len = pg_ntoh32(ext_len);
+        if (ext_len > (uint32)(buf->len - BINARY_HEADER_MIN_LEN))
+            return;
+        ci->header_len = BINARY_HEADER_MIN_LEN + (int)ext_len;
+        ci->header = pnstrdup(buf->data, ci->header_len);
+        ci->scan_pos = ci->boundary = ci->header_len;
+    }
+
+    // Walk whole tuples: int16 field count, then int32 length and data for
+    // each field, or a field count of -1 as the trailer
+    while (buf->len - ci->scan_pos >= 2) {
+        int16 nfields;
+        memcpy(&nfields, buf->data + ci->scan_pos, 2);
+        nfields = (int16)pg_ntoh16(nfields);
+        if (nfields < 0) {
+            ci->scan_done = true;
+            return;
+        }
+        int64 pos = ci->scan_pos + 2;
+        for (int i = 0; i < nfields; i++) {
+            if (buf->len - pos < 4)
+                return;
+            int32 field_len;
+            memcpy(&field_len, buf->data + pos, 4);
+            field_len = (int32)pg_ntoh32(field_len);
+            pos += 4 + Max(field_len, 0);
+            if (pos > buf->len)
+                return;
+        }
+        ci->scan_pos = ci->boundary = (int)pos;
+    }
+}
+
+// Makes the parse state of a COPY FROM into rel like DoCopy() does, with the
+// range table CopyFrom() runs against and the permissions it needs
+static ParseState *
+make_copy_pstate(const char *sql, Relation rel, List *attnamelist) {
+    ParseState *pstate = make_parsestate(NULL);
+    pstate->p_sourcetext = sql;
+    ParseNamespaceItem *nsitem = addRangeTableEntryForRelation(pstate,
+                                                               rel,
+                                                               RowExclusiveLock,
+                                                               NULL,
+                                                               false,
+                                                               false);
+    RTEPermissionInfo *perminfo = nsitem->p_perminfo;
+    perminfo->requiredPerms = ACL_INSERT;
+    addNSItemToQuery(pstate, nsitem, true, true, true);
+
+    ListCell *lc;
+    List *attnums = CopyGetAttnums(RelationGetDescr(rel), rel, attnamelist);
+    foreach (lc, attnums) {
+        int attno = lfirst_int(lc) - FirstLowInvalidHeapAttributeNumber;
+        perminfo->insertedCols = bms_add_member(perminfo->insertedCols, attno);
+    }
+    return pstate;
+}
+
+// Loads the first len bytes of the buffer with one COPY run
+static void
+load_batch(CopyIngest *ci, int len) {
+    bool with_header = ci->batches > 0 && ci->header_len > 0;
+    copy_source.data[0] = with_header ? ci->header : NULL;
+    copy_source.len[0] = with_header ? ci->header_len : 0;
+    copy_source.data[1] = ci->buf.data;
+    copy_source.len[1] = len;
+    copy_source.part = 0;
+    copy_source.pos = 0;
+
+    Relation rel = table_open(ci->relid, RowExclusiveLock);
+    ParseState *pstate = make_copy_pstate(NULL, rel, ci->attnamelist);
+    PushActiveSnapshot(GetTransactionSnapshot());
+    CopyFromState cstate =
+        BeginCopyFrom(pstate,
+                      rel,
+                      NULL,
+                      NULL,
+                      false,
+                      copy_source_read,
+                      ci->attnamelist,
+                      ci->batches == 0 ? ci->options : ci->next_options);
+    ci->rows += CopyFrom(cstate);
+    EndCopyFrom(cstate);
+    rst_result_cache_note_write_rel(ci->relid);
+    PopActiveSnapshot();
+    free_parsestate(pstate);
+    table_close(rel, NoLock);
+    CommandCounterIncrement();
+    ci->batches++;
+
+    // Keep the partial record for the next batch
+    StringInfo buf = &ci->buf;
+    memmove(buf->data, buf->data + len, buf->len - len);
+    buf->len -= len;
+    buf->data[buf->len] = '\0';
+    ci->scan_pos -= len;
+    ci->boundary -= len;
+}
+
+static CopyIngest *
+copy_ingest_new(const char *sql) {
+    List *parsetree_list = raw_parser(sql, RAW_PARSE_DEFAULT);
+    if (list_length(parsetree_list) != 1)
+        ereport(ERROR,
+                errmsg("expect exactly 1 SQL statement, found %d",
+                       list_length(parsetree_list)));
+    Node *node = linitial_node(RawStmt, parsetree_list)->stmt;
+    if (!IsA(node, CopyStmt))
+        ereport(ERROR, errmsg("expected a COPY statement"));
+    CopyStmt *stmt = (CopyStmt *)node;
+    if (!stmt->is_from || stmt->filename || stmt->is_program || !stmt->relation)
+        ereport(ERROR, errmsg("only COPY table FROM STDIN is supported"));
+    if (stmt->whereClause)
+        ereport(ERROR, errmsg("COPY FROM with WHERE is not supported"));
+
+    CopyIngest *ci = palloc0(sizeof(CopyIngest));
+    ci->attnamelist = stmt->attlist;
+    ci->options = stmt->options;
+    ci->format = INGEST_TEXT;
+    ci->quote = '"';
+    ci->escape = '\0';
+    ListCell *lc;
+    foreach (lc, stmt->options) {
+        DefElem *defel = lfirst_node(DefElem, lc);
+        if (strcmp(defel->defname, "header") == 0)
+            continue;
+        ci->next_options = lappend(ci->next_options, defel);
+        if (strcmp(defel->defname, "format") == 0) {
+            char *fmt = defGetString(defel);
+            if (strcmp(fmt, "csv") == 0)
+                ci->format = INGEST_CSV;
+            else if (strcmp(fmt, "binary") == 0)
+                ci->format = INGEST_BINARY;
+        }
+        else if (strcmp(defel->defname, "quote") == 0) {
+            ci->quote = defGetString(defel)[0];
+        }
+        else if (strcmp(defel->defname, "escape") == 0) {
+            ci->escape = defGetString(defel)[0];
+        }
+    }
+    if (ci->escape == '\0')
+        ci->escape = ci->quote;
+
+    // Same checks as DoCopy() for a plain COPY FROM into a table, including
+    // column-level INSERT privileges
+    Relation rel = table_openrv(stmt->relation, RowExclusiveLock);
+    ci->relid = RelationGetRelid(rel);
+    ParseState *pstate = make_copy_pstate(sql, rel, ci->attnamelist);
+    ExecCheckPermissions(pstate->p_rtable, pstate->p_rteperminfos, true);
+    free_parsestate(pstate);
+    if (check_enable_rls(ci->relid, InvalidOid, false) == RLS_ENABLED)
+        ereport(ERROR,
+                errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("COPY FROM not supported with row-level security"));
+    if (XactReadOnly && !rel->rd_islocaltemp)
+        PreventCommandIfReadOnly("COPY FROM");
+    table_close(rel, NoLock);
+
+    initStringInfo(&ci->buf);
+    return ci;
+}
+
+void
+rst_copy_ingest_free(CopyIngest *ci) {
+    if (ci->buf.data)
+        pfree(ci->buf.data);
+    if (ci->header)
+        pfree(ci->header);
+    pfree(ci);
+}
+
+static CopyIngest *
+copy_ingest_of(wasm_obj_t copy_ref) {
+    obj_t obj = wasm_externref_obj_get_obj(copy_ref, OBJ_COPY_FROM);
+    CopyIngest *ci = (CopyIngest *)obj->body.ptr;
+    if (ci->finished)
+        ereport(ERROR, errmsg("COPY FROM already finished"));
+    return ci;
+}
+
+static int32_t
+rows_as_int32(uint64 rows) {
+    if (rows > INT_MAX)
+        ereport(ERROR, errmsg("too many rows"));
+    return (int32_t)rows;
+}
+
+// Starts a "COPY table [(columns)] FROM STDIN [WITH (...)]" in the current
+// transaction, in text, csv or binary format
+static wasm_externref_obj_t
+env_copy_from_begin(wasm_exec_env_t exec_env, wasm_obj_t sql_ref) {
+    char *sql = wasm_text_copy_cstring(sql_ref);
+    ereport(DEBUG1, errmsg("copy_from_begin: %s", sql));
+    CopyIngest *ci = copy_ingest_new(sql);
+    obj_t obj = rst_obj_new(exec_env, OBJ_COPY_FROM, NULL, 0);
+    obj->flags |= OBJ_OWNS_BODY;
+    obj->body.ptr = ci;
+    return rst_externref_of_obj(exec_env, obj);
+}
+
+// Feeds a chunk of input, like a part of a request body. Complete records
+// are loaded whenever they add up to a batch. Returns the rows loaded so far.
+static int32_t
+env_copy_from_write(wasm_exec_env_t exec_env,
+                    wasm_obj_t copy_ref,
+                    wasm_obj_t bytes_ref,
+                    int32_t start,
+                    int32_t len) {
+    CopyIngest *ci = copy_ingest_of(copy_ref);
+    char *data = rst_bytes_view(bytes_ref, start, len, NULL);
+    appendBinaryStringInfo(&ci->buf, data, len);
+    if (!ci->scan_done) {
+        switch (ci->format) {
+            case INGEST_TEXT:
+                scan_text(ci);
+                break;
+            case INGEST_CSV:
+                scan_csv(ci);
+                break;
+            case INGEST_BINARY:
+                scan_binary(ci);
+                break;
+        }
+    }
+    if (ci->boundary >= COPY_BATCH_SIZE)
+        load_batch(ci, ci->boundary);
+    return rows_as_int32(ci->rows);
+}
+
+// Loads the rest of the input. Returns the total number of rows loaded.
+static int32_t
+env_copy_from_finish(wasm_exec_env_t exec_env, wasm_obj_t copy_ref) {
+    CopyIngest *ci = copy_ingest_of(copy_ref);
+    if (ci->buf.len > 0 || ci->batches == 0)
+        load_batch(ci, ci->buf.len);
+    ci->finished = true;
+    ereport(DEBUG1,
+            errmsg("copy_from_finish: " UINT64_FORMAT " rows in %d batches",
+                   ci->rows,
+                   ci->batches));
+    return rows_as_int32(ci->rows);
+}
+
+static NativeSymbol copy_symbols[] = {
+    { "copy_from_begin", env_copy_from_begin, "(r)r" },
+    { "copy_from_write", env_copy_from_write, "(rrii)i" },
+    { "copy_from_finish", env_copy_from_finish, "(r)i" },
+};
+
+void
+rst_register_natives_copy() {
+    REGISTER_WASM_NATIVES("env", copy_symbols);
+}
@@ -0,0 +1,17 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#ifndef RUSTICA_COPY_H
+#define RUSTICA_COPY_H
+
+#include "postgres.h"
+
+typedef struct CopyIngest CopyIngest;
+
+void
+rst_copy_ingest_free(CopyIngest *ci);
+
+void
+rst_register_natives_copy();
+
+#endif /* RUSTICA_COPY_H */
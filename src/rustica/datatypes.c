@@ -2,11 +2,63 @@
 // SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
 
 #include "postgres.h"
+#include "port/pg_bitutils.h"
 #include "utils/builtins.h"
+#include "utils/memutils.h"
 
+#include "rustica/copy.h"
 #include "rustica/datatypes.h"
 #include "rustica/wamr.h"
 
+// Per-worker pool of bytea buffers in power-of-two classes from 4kB to 1MB,
+// recycled across requests so that I/O buffers don't hit palloc in the steady
+// state. The class size includes the varlena header, and each buffer is
+// allocated page-aligned so that it spans whole pages; the data itself starts
+// VARHDRSZ bytes into the first page.
+#define BYTEA_POOL_MIN_SHIFT 12
+#define BYTEA_POOL_MAX_SHIFT 20
+#define BYTEA_POOL_NCLASSES (BYTEA_POOL_MAX_SHIFT - BYTEA_POOL_MIN_SHIFT + 1)
+#define BYTEA_POOL_DEPTH 8
+
+typedef struct ByteaPoolClass {
+    int nfree;
+    bytea *free[BYTEA_POOL_DEPTH];
+} ByteaPoolClass;
+
+static ByteaPoolClass bytea_pool[BYTEA_POOL_NCLASSES];
+
+static inline int
+bytea_pool_class(uint32 size) {
+    return Max((int)pg_ceil_log2_32(size), BYTEA_POOL_MIN_SHIFT)
+           - BYTEA_POOL_MIN_SHIFT;
+}
+
+static bytea *
+bytea_pool_acquire(uint32 size) {
+    int cls = bytea_pool_class(size);
+    ByteaPoolClass *pool = &bytea_pool[cls];
+    bytea *rv;
+    if (pool->nfree > 0)
+        rv = pool->free[--pool->nfree];
+    else
+        rv = (bytea *)MemoryContextAllocAligned(
+            TopMemoryContext,
+            (Size)1 << (cls + BYTEA_POOL_MIN_SHIFT),
+            PG_IO_ALIGN_SIZE,
+            0);
+    SET_VARSIZE(rv, size);
+    return rv;
+}
+
+static void
+bytea_pool_release(bytea *buf) {
+    ByteaPoolClass *pool = &bytea_pool[bytea_pool_class(VARSIZE(buf))];
+    if (pool->nfree < BYTEA_POOL_DEPTH)
+        pool->free[pool->nfree++] = buf;
+    else
+        pfree(buf);
+}
+
 static void
 obj_finalizer(wasm_obj_t wasm_obj, void *ptr) {
     obj_t obj = (obj_t)wasm_anyref_obj_get_value((wasm_anyref_obj_t)wasm_obj);
@@ -14,7 +66,9 @@ obj_finalizer(wasm_obj_t wasm_obj, void *ptr) {
 
     switch (obj->type) {
         case OBJ_DATUM:
-            if (obj->flags & OBJ_OWNS_BODY)
+            if (obj->flags & OBJ_POOLED_BODY)
+                bytea_pool_release((bytea *)DatumGetPointer(obj->body.datum));
+            else if (obj->flags & OBJ_OWNS_BODY)
                 pfree(DatumGetPointer(obj->body.datum));
             break;
 
@@ -44,18 +98,29 @@ obj_finalizer(wasm_obj_t wasm_obj, void *ptr) {
                 pfree(obj->body.jbv);
             break;
 
-        case OBJ_PORTAL:
-            if (PortalIsValid(obj->body.portal))
-                SPI_cursor_close(obj->body.portal);
+        case OBJ_PORTAL: {
+            Portal portal = rst_obj_get_portal(obj);
+            if (PortalIsValid(portal))
+                SPI_cursor_close(portal);
             break;
+        }
 
         case OBJ_TUPLE_TABLE:
-            SPI_freetuptable(obj->body.tuptable);
+            // Rows from the result cache aren't known to SPI
+            if (obj->flags & OBJ_CACHED_BODY)
+                MemoryContextDelete(obj->body.tuptable->tuptabcxt);
+            else
+                SPI_freetuptable(obj->body.tuptable);
             break;
 
         case OBJ_HEAP_TUPLE:
             break;
 
+        case OBJ_COPY_FROM:
+            if (obj->flags & OBJ_OWNS_BODY)
+                rst_copy_ingest_free(obj->body.ptr);
+            break;
+
         default:
             break;
     }
@@ -160,11 +225,48 @@ wasm_externref_obj_get_datum(wasm_obj_t refobj, Oid oid) {
     PG_RETURN_DATUM(obj->body.datum);
 }
 
+// Cursors are looked up by name on each use, because the portal is gone
+// once the transaction of the request that opened it commits. Returns NULL
+// if the cursor is closed either way.
+Portal
+rst_obj_get_portal(obj_t obj) {
+    Assert(obj->type == OBJ_PORTAL);
+    if (obj->body.portal_name == NULL)
+        return NULL;
+    return SPI_cursor_find(obj->body.portal_name);
+}
+
 char *
 wasm_text_copy_cstring(wasm_obj_t refobj) {
     return TextDatumGetCString(wasm_externref_obj_get_datum(refobj, TEXTOID));
 }
 
+char *
+rst_bytes_view(wasm_obj_t refobj, int32 start, int32 len, char **base) {
+    char *data;
+    uint32 size;
+    if (refobj && !wasm_obj_is_externref_obj(refobj)
+        && wasm_obj_is_array_obj(refobj)) {
+        // GC (array i8), so that AOT code can access the bytes directly
+        wasm_array_obj_t array = (wasm_array_obj_t)refobj;
+        if (wasm_array_obj_elem_size_log(array) != 0)
+            ereport(ERROR, errmsg("expected an array of i8"));
+        data = (char *)wasm_array_obj_first_elem_addr(array);
+        size = wasm_array_obj_length(array);
+    }
+    else {
+        bytea *bytes = (bytea *)DatumGetPointer(
+            wasm_externref_obj_get_datum(refobj, BYTEAOID));
+        data = VARDATA_ANY(bytes);
+        size = VARSIZE_ANY_EXHDR(bytes);
+    }
+    if (start < 0 || len < 0 || (uint32)start + (uint32)len > size)
+        ereport(ERROR, errmsg("bytes view out of bound"));
+    if (base)
+        *base = data;
+    return data + start;
+}
+
 wasm_externref_obj_t
 rst_externref_of_owned_datum(wasm_exec_env_t exec_env, Datum datum, Oid oid) {
     obj_t obj = rst_obj_new(exec_env, OBJ_DATUM, NULL, 0);
@@ -196,6 +298,32 @@ cstring_into_varatt_obj(wasm_exec_env_t exec_env,
     return rst_externref_of_obj(exec_env, obj);
 }
 
+wasm_externref_obj_t
+rst_bytea_obj_new_uninit(wasm_exec_env_t exec_env, int32 len) {
+    if (len < 0 || len > VARATT_MAX - VARHDRSZ)
+        ereport(ERROR, errmsg("bytea_new: invalid length %d", len));
+    uint32 size = (uint32)len + VARHDRSZ;
+    obj_t obj;
+    if (size < ((uint32)1 << BYTEA_POOL_MIN_SHIFT)) {
+        // Small buffers are embedded in the object itself
+        obj = rst_obj_new(exec_env, OBJ_DATUM, NULL, size);
+        SET_VARSIZE(obj->body.ptr, size);
+    }
+    else if (size <= ((uint32)1 << BYTEA_POOL_MAX_SHIFT)) {
+        obj = rst_obj_new(exec_env, OBJ_DATUM, NULL, 0);
+        obj->flags |= OBJ_POOLED_BODY;
+        obj->body.ptr = bytea_pool_acquire(size);
+    }
+    else {
+        obj = rst_obj_new(exec_env, OBJ_DATUM, NULL, 0);
+        obj->flags |= OBJ_OWNS_BODY;
+        obj->body.ptr = palloc(size);
+        SET_VARSIZE(obj->body.ptr, size);
+    }
+    obj->oid = BYTEAOID;
+    return rst_externref_of_obj(exec_env, obj);
+}
+
 void
 wasm_runtime_remove_local_obj_ref(wasm_exec_env_t exec_env,
                                   wasm_local_obj_ref_t *me) {
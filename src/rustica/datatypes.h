@@ -31,10 +31,13 @@
 #define OBJ_TUPLE_TABLE 4
 #define OBJ_HEAP_TUPLE 5
 #define OBJ_CLOCK_MONOTONIC 6
+#define OBJ_COPY_FROM 7
 
 #define OBJ_REFERENCING (1 << 0)
 #define OBJ_OWNS_BODY (1 << 1)
 #define OBJ_OWNS_BODY_MEMBERS (1 << 2)
+#define OBJ_POOLED_BODY (1 << 3)
+#define OBJ_CACHED_BODY (1 << 4)
 
 typedef uint16_t ObjType;
 
@@ -54,7 +57,7 @@ typedef struct Obj {
         Datum datum;             // only for OBJ_DATUM
         StringInfo sb;           // only for OBJ_STRING_INFO
         JsonbValue *jbv;         // only for OBJ_JSONB_VALUE
-        Portal portal;           // only for OBJ_PORTAL
+        char *portal_name;       // only for OBJ_PORTAL, NULL once closed
         SPITupleTable *tuptable; // only for OBJ_TUPLE_TABLE
         HeapTuple tuple;         // only for OBJ_HEAP_TUPLE
         instr_time instr_time;   // only for OBJ_CLOCK_MONOTONIC
@@ -84,12 +87,18 @@ rst_obj_new_static(ObjType type, obj_t *obj_out, size_t embed_size);
 obj_t
 wasm_externref_obj_get_obj(wasm_obj_t refobj, ObjType type);
 
+Portal
+rst_obj_get_portal(obj_t obj);
+
 Datum
 wasm_externref_obj_get_datum(wasm_obj_t refobj, Oid oid);
 
 char *
 wasm_text_copy_cstring(wasm_obj_t refobj);
 
+char *
+rst_bytes_view(wasm_obj_t refobj, int32 start, int32 len, char **base);
+
 wasm_externref_obj_t
 rst_externref_of_owned_datum(wasm_exec_env_t exec_env, Datum datum, Oid oid);
 
@@ -99,6 +108,9 @@ cstring_into_varatt_obj(wasm_exec_env_t exec_env,
                         size_t llen,
                         Oid oid);
 
+wasm_externref_obj_t
+rst_bytea_obj_new_uninit(wasm_exec_env_t exec_env, int32 len);
+
 void
 rst_register_natives_bytea();
 
@@ -5,17 +5,28 @@
 #include "postmaster/bgworker.h"
 #include "utils/memutils.h"
 
+#include "rustica/aot_cache.h"
 #include "rustica/compiler.h"
 #include "rustica/gucs.h"
+#include "rustica/route.h"
+#include "rustica/shmem.h"
+#include "rustica/stats.h"
 #include "rustica/wamr.h"
 
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(compile_wasm);
+PG_FUNCTION_INFO_V1(worker_stats);
+PG_FUNCTION_INFO_V1(worker_module_memory);
+PG_FUNCTION_INFO_V1(aot_image_size);
+PG_FUNCTION_INFO_V1(query_stats);
+PG_FUNCTION_INFO_V1(query_stats_reset);
+PG_FUNCTION_INFO_V1(invalidate_routes);
 
 void
 _PG_init() {
     rst_init_gucs();
+    rst_init_shmem();
 
     MemoryContext tx_mctx = MemoryContextSwitchTo(TopMemoryContext);
     rst_init_wamr();
@@ -38,6 +49,36 @@ compile_wasm(PG_FUNCTION_ARGS) {
     return rst_compile(fcinfo);
 }
 
+Datum
+worker_stats(PG_FUNCTION_ARGS) {
+    return rst_worker_stats_srf(fcinfo);
+}
+
+Datum
+worker_module_memory(PG_FUNCTION_ARGS) {
+    return rst_worker_module_memory_srf(fcinfo);
+}
+
+Datum
+aot_image_size(PG_FUNCTION_ARGS) {
+    return rst_aot_image_size(fcinfo);
+}
+
+Datum
+query_stats(PG_FUNCTION_ARGS) {
+    return rst_query_stats_srf(fcinfo);
+}
+
+Datum
+query_stats_reset(PG_FUNCTION_ARGS) {
+    return rst_query_stats_reset(fcinfo);
+}
+
+Datum
+invalidate_routes(PG_FUNCTION_ARGS) {
+    return rst_route_invalidate_trigger(fcinfo);
+}
+
 void
 _PG_fini() {
     rst_fini_wamr();
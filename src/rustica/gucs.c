@@ -10,6 +10,18 @@ char *rst_listen_addresses = NULL;
 int rst_port = 8080;
 int rst_worker_idle_timeout = 60;
 char *rst_database = NULL;
+bool rst_compile_xip = false;
+bool rst_aot_disk_cache = true;
+int rst_module_cache_size = 512 * 1024;
+int rst_module_cache_entries = 64;
+char *rst_preload_modules = NULL;
+int rst_fetch_min_rows = 16;
+int rst_fetch_max_rows = 10000;
+int rst_fetch_target_bytes = 256;
+int rst_fetch_target_latency = 10;
+int rst_query_stats_max = 5000;
+int rst_result_cache_size = 16 * 1024;
+int rst_result_cache_entry_size = 16;
 
 void
 rst_init_gucs() {
@@ -58,4 +70,156 @@ rst_init_gucs() {
                                NULL,
                                NULL,
                                NULL);
+    DefineCustomBoolVariable(
+        "rustica.compile_xip",
+        "Compiles modules into execute-in-place AOT images.",
+        "XIP images need no text relocation, so workers can execute the "
+        "shared code cache in place instead of copying it.",
+        &rst_compile_xip,
+        false,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomBoolVariable(
+        "rustica.aot_disk_cache",
+        "Caches AOT images under $PGDATA/rustica_cache.",
+        "Workers mmap() cached images instead of reading bin_code.",
+        &rst_aot_disk_cache,
+        true,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.module_cache_size",
+        "Sets the memory budget of loaded modules in each worker.",
+        "Least recently used modules are unloaded beyond this size.",
+        &rst_module_cache_size,
+        512 * 1024,
+        1024,
+        INT_MAX,
+        PGC_USERSET,
+        GUC_UNIT_KB,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.module_cache_entries",
+        "Sets the maximum number of loaded modules in each worker.",
+        "Least recently used modules are unloaded beyond this number.",
+        &rst_module_cache_entries,
+        64,
+        1,
+        INT_MAX,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomStringVariable(
+        "rustica.preload_modules",
+        "Lists modules to load when a worker starts.",
+        "Comma-separated module names; their imports are loaded too. "
+        "Preloaded modules are never evicted from the module cache.",
+        &rst_preload_modules,
+        "",
+        PGC_USERSET,
+        GUC_LIST_INPUT,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.fetch_min_rows",
+        "Sets the minimum batch size of adaptive cursor fetches.",
+        "Also the size of the first fetch of a query.",
+        &rst_fetch_min_rows,
+        16,
+        1,
+        INT_MAX,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.fetch_max_rows",
+        "Sets the maximum batch size of adaptive cursor fetches.",
+        NULL,
+        &rst_fetch_max_rows,
+        10000,
+        1,
+        INT_MAX,
+        PGC_USERSET,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.fetch_target_bytes",
+        "Sets the memory an adaptive cursor fetch aims to use.",
+        "Batches shrink when rows are wide.",
+        &rst_fetch_target_bytes,
+        256,
+        1,
+        INT_MAX / 1024,
+        PGC_USERSET,
+        GUC_UNIT_KB,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.fetch_target_latency",
+        "Sets the time an adaptive cursor fetch aims to take.",
+        "Batches shrink when rows are slow to produce; 0 to ignore latency.",
+        &rst_fetch_target_latency,
+        10,
+        0,
+        INT_MAX,
+        PGC_USERSET,
+        GUC_UNIT_MS,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.query_stats_max",
+        "Sets the maximum number of queries tracked in rustica.query_stats.",
+        "Queries beyond this number are not tracked until a reset.",
+        &rst_query_stats_max,
+        5000,
+        100,
+        INT_MAX / 2,
+        PGC_POSTMASTER,
+        0,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.result_cache_size",
+        "Sets the shared memory for results of queries with a cache_ttl.",
+        "0 disables the result cache.",
+        &rst_result_cache_size,
+        16 * 1024,
+        0,
+        INT_MAX,
+        PGC_POSTMASTER,
+        GUC_UNIT_KB,
+        NULL,
+        NULL,
+        NULL);
+    DefineCustomIntVariable(
+        "rustica.result_cache_entry_size",
+        "Sets the size of each entry in the result cache.",
+        "Larger results are not cached.",
+        &rst_result_cache_entry_size,
+        16,
+        1,
+        1024 * 1024,
+        PGC_POSTMASTER,
+        GUC_UNIT_KB,
+        NULL,
+        NULL,
+        NULL);
 }
@@ -8,6 +8,18 @@ extern char *rst_listen_addresses;
 extern int rst_port;
 extern int rst_worker_idle_timeout;
 extern char *rst_database;
+extern bool rst_compile_xip;
+extern bool rst_aot_disk_cache;
+extern int rst_module_cache_size;
+extern int rst_module_cache_entries;
+extern char *rst_preload_modules;
+extern int rst_fetch_min_rows;
+extern int rst_fetch_max_rows;
+extern int rst_fetch_target_bytes;
+extern int rst_fetch_target_latency;
+extern int rst_query_stats_max;
+extern int rst_result_cache_size;
+extern int rst_result_cache_entry_size;
 
 void
 rst_init_gucs();
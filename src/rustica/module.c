@@ -2,29 +2,74 @@
 // SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
 
 #include "postgres.h"
+#include "access/htup_details.h"
 #include "executor/spi.h"
 #include "tcop/tcopprot.h"
 #include "utils/builtins.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/typcache.h"
 
+#include "rustica/gucs.h"
 #include "rustica/module.h"
+#include "rustica/stats.h"
 #include "rustica/utils.h"
 
+static dlist_head loaded_modules = DLIST_STATIC_INIT(loaded_modules);
+static List *preparing_modules = NIL;
 static SPIPlanPtr load_module_plan = NULL;
-static SPIPlanPtr load_module_queries_plan = NULL;
+static SPIPlanPtr module_generation_plan = NULL;
+
+// Fetch the module with its whole dependency closure and all their queries in
+// one round-trip, dependencies ordered before their importers.
 static const char *load_module_sql =
-    "SELECT bin_code, heap_types FROM rustica.modules WHERE name = $1";
-static const char *load_module_queries_sql =
-    "SELECT * FROM rustica.queries WHERE module = $1 ORDER BY index";
+    "WITH RECURSIVE closure(name, depth) AS ("
+    "    SELECT $1, 0"
+    "  UNION ALL"
+    "    SELECT dep, c.depth + 1"
+    "    FROM closure c"
+    "    JOIN rustica.modules m ON m.name = c.name,"
+    "    unnest(m.imports) AS dep"
+    ") CYCLE name SET is_cycle USING path "
+    "SELECT m.name, m.bin_code, m.heap_types, m.bin_code_hash,"
+    "       m.bin_code_size, m.generation,"
+    "       ARRAY(SELECT q FROM rustica.queries q"
+    "             WHERE q.module = m.name ORDER BY q.index) "
+    "FROM (SELECT name, max(depth) AS depth FROM closure"
+    "      WHERE NOT is_cycle GROUP BY name) c "
+    "JOIN rustica.modules m ON m.name = c.name "
+    "ORDER BY c.depth DESC";
+static const char *module_generation_sql =
+    "SELECT generation FROM rustica.modules WHERE name = $1";
 
 static PreparedModule *
-create_module_with_queries(Datum name);
+create_module_with_queries(const char *name, Datum queries);
 
 static void
 load_heap_types(ArrayType *array, CommonHeapTypes *heap_types);
 
+static PreparedModule *
+prepare_module(const char *name,
+               uint8 **buffer,
+               uint32 *size,
+               bool do_register);
+
+static PreparedModule *
+prepare_module_row(HeapTuple row,
+                   TupleDesc tupdesc,
+                   uint8 **buffer,
+                   uint32 *size,
+                   bool do_register);
+
 static AOTModule *
-load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len);
+load_aot_module(const char *name,
+                uint8 *bin_code,
+                uint32_t bin_code_len,
+                bool freeable,
+                bool do_register);
+
+static PreparedModule *
+find_importer(PreparedModule *dep);
 
 void
 rst_module_worker_startup() {
@@ -37,26 +82,131 @@ rst_module_worker_startup() {
     if (SPI_keepplan(load_module_plan))
         ereport(ERROR, errmsg("failed to keep plan"));
 
-    debug_query_string = load_module_queries_sql;
-    load_module_queries_plan =
-        SPI_prepare(load_module_queries_sql, 1, (Oid[1]){ TEXTOID });
-    if (!load_module_queries_plan)
+    debug_query_string = module_generation_sql;
+    module_generation_plan =
+        SPI_prepare(module_generation_sql, 1, (Oid[1]){ TEXTOID });
+    if (!module_generation_plan)
         ereport(ERROR,
-                (errmsg("could not prepare SPI plan: %s",
-                        SPI_result_code_string(SPI_result))));
-    if (SPI_keepplan(load_module_queries_plan))
-        ereport(ERROR, (errmsg("failed to keep plan")));
+                errmsg("could not prepare SPI plan: %s",
+                       SPI_result_code_string(SPI_result)));
+    if (SPI_keepplan(module_generation_plan))
+        ereport(ERROR, errmsg("failed to keep plan"));
     debug_query_string = NULL;
 }
 
 void
 rst_module_worker_teardown() {
     SPI_freeplan(load_module_plan);
-    SPI_freeplan(load_module_queries_plan);
+    SPI_freeplan(module_generation_plan);
 }
 
 PreparedModule *
 rst_prepare_module(const char *name, uint8 **buffer, uint32 *size) {
+    return prepare_module(name, buffer, size, true);
+}
+
+// An importer unloaded by a swap, to be loaded again the way it was
+typedef struct UnloadedImporter {
+    char name[RST_MODULE_NAME_MAXLEN + 1];
+    bool pinned;
+} UnloadedImporter;
+
+// Unloads the direct and indirect importers of dep, appending them to the
+// list in the order they are unloaded
+static List *
+unload_importers(PreparedModule *dep, List *unloaded) {
+    PreparedModule *importer;
+    while ((importer = find_importer(dep)) != NULL) {
+        unloaded = unload_importers(importer, unloaded);
+        UnloadedImporter *entry = palloc(sizeof(UnloadedImporter));
+        strlcpy(entry->name, importer->name, sizeof(entry->name));
+        entry->pinned = importer->pinned;
+        unloaded = lappend(unloaded, entry);
+        rst_unload_module(importer);
+    }
+    return unloaded;
+}
+
+static void
+reload_importers(List *unloaded) {
+    ListCell *lc;
+    foreach (lc, unloaded) {
+        UnloadedImporter *entry = (UnloadedImporter *)lfirst(lc);
+        PreparedModule *pmod = rst_lookup_module(entry->name);
+        if (!pmod)
+            pmod = rst_prepare_module(entry->name, NULL, NULL);
+        pmod->pinned = entry->pinned;
+        if (pmod->pinned)
+            rst_module_prepare_plans(pmod);
+    }
+}
+
+PreparedModule *
+rst_reload_module(PreparedModule *old) {
+    char name[RST_MODULE_NAME_MAXLEN + 1];
+    Datum name_datum = CStringGetTextDatum(old->name);
+    strlcpy(name, old->name, sizeof(name));
+
+    debug_query_string = module_generation_sql;
+    int ret =
+        SPI_execute_plan(module_generation_plan, &name_datum, NULL, true, 1);
+    if (ret != SPI_OK_SELECT)
+        ereport(ERROR,
+                errmsg("failed to query module \"%s\": %s",
+                       name,
+                       SPI_result_code_string(ret)));
+    debug_query_string = NULL;
+    pfree(DatumGetPointer(name_datum));
+    if (SPI_processed == 0) {
+        SPI_freetuptable(SPI_tuptable);
+        rst_unload_module(old);
+        return NULL;
+    }
+    bool isnull;
+    int64 generation = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+                                                   SPI_tuptable->tupdesc,
+                                                   1,
+                                                   &isnull));
+    SPI_freetuptable(SPI_tuptable);
+    if (generation == old->generation)
+        return old;
+
+    // Prepare the new version while the old one stays registered, so that a
+    // failure here leaves the old version in service.
+    PreparedModule *pmod = prepare_module(name, NULL, NULL, false);
+
+    // Importers are linked against the old version: unload them now and
+    // load them again against whichever version is registered afterwards.
+    List *importers = unload_importers(old, NIL);
+
+    // Swap, no instance of the old version is alive between connections.
+    // Both can't be registered under the same name, so the old version is
+    // only freed once the new one is registered, and restored otherwise.
+    DECLARE_ERROR_BUF(128);
+    pmod->pinned = old->pinned;
+    wasm_runtime_unregister_module((wasm_module_t)old->module);
+    if (!wasm_runtime_register_module((const char *)pmod,
+                                      (wasm_module_t)pmod->module,
+                                      ERROR_BUF_PARAMS)) {
+        rst_free_module(pmod);
+        if (wasm_runtime_register_module((const char *)old,
+                                         (wasm_module_t)old->module,
+                                         NULL,
+                                         0))
+            reload_importers(importers);
+        ereport(ERROR,
+                errmsg("cannot register module \"%s\": %s", name, ERROR_BUF));
+    }
+    rst_free_module(old);
+    rst_module_loaded(pmod);
+
+    reload_importers(importers);
+    list_free_deep(importers);
+    return pmod;
+}
+
+static void
+check_module_name(const char *name) {
     // We use wasm_module_t->name as a pointer to PreparedModule which starts
     // with maximum-128 chars of name, so we had to limit the name length here.
     if (strlen(name) > RST_MODULE_NAME_MAXLEN)
@@ -64,71 +214,78 @@ rst_prepare_module(const char *name, uint8 **buffer, uint32 *size) {
                 errmsg("module name too long (%ld bytes): maximum %d bytes",
                        strlen(name),
                        RST_MODULE_NAME_MAXLEN));
+}
+
+static bool
+is_preparing(const char *name) {
+    ListCell *lc;
+    foreach (lc, preparing_modules)
+        if (strcmp((const char *)lfirst(lc), name) == 0)
+            return true;
+    return false;
+}
+
+static PreparedModule *
+prepare_module(const char *name,
+               uint8 **buffer,
+               uint32 *size,
+               bool do_register) {
+    check_module_name(name);
 
     PreparedModule *pmod = NULL;
     SPITupleTable *tuptable = NULL;
     Datum name_datum = CStringGetTextDatum(name);
+    MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
+    preparing_modules = lcons((void *)name, preparing_modules);
+    MemoryContextSwitchTo(old_context);
 
     PG_TRY();
     {
-        PG_TRY(2);
-        {
-            // Create the PreparedModule with all pre-compiled queries
-            pmod = create_module_with_queries(name_datum);
-
-            // Query the rustica.modules table
-            debug_query_string = load_module_sql;
-            int ret =
-                SPI_execute_plan(load_module_plan, &name_datum, NULL, true, 1);
-            if (ret != SPI_OK_SELECT)
-                ereport(ERROR,
-                        errmsg("failed to load module \"%s\": %s",
-                               name,
-                               SPI_result_code_string(ret)));
-            tuptable = SPI_tuptable;
-            if (SPI_processed == 0)
-                ereport(ERROR,
-                        errcode(ERRCODE_NO_DATA_FOUND),
-                        errmsg("module \"%s\" doesn't exist", name));
+        debug_query_string = load_module_sql;
+        int ret =
+            SPI_execute_plan(load_module_plan, &name_datum, NULL, true, 0);
+        if (ret != SPI_OK_SELECT)
+            ereport(ERROR,
+                    errmsg("failed to load module \"%s\": %s",
+                           name,
+                           SPI_result_code_string(ret)));
+        tuptable = SPI_tuptable;
+        debug_query_string = NULL;
 
-            // Take out the raw data from the tuptable
-            bool isnull;
-            Datum datum =
-                SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 1, &isnull);
-            Assert(!isnull);
-            bytea *bin_code = DatumGetByteaPP(datum);
-            datum =
-                SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 2, &isnull);
-            Assert(!isnull);
-            ArrayType *heap_types = DatumGetArrayTypeP(datum);
-            debug_query_string = NULL;
-
-            // Load heap_types and the actual WASM module
-            load_heap_types(heap_types, &pmod->heap_types);
-            if (buffer) {
-                Assert(size != NULL);
-                *buffer = (uint8 *)VARDATA_ANY(bin_code);
-                *size = VARSIZE_ANY_EXHDR(bin_code);
-                pmod->loading_tuptable = tuptable;
-            }
-            else {
-                pmod->module = load_aot_module((const char *)pmod,
-                                               (uint8 *)VARDATA_ANY(bin_code),
-                                               VARSIZE_ANY_EXHDR(bin_code));
-                SPI_freetuptable(tuptable);
-                tuptable = NULL;
-            }
+        // Load and register the missing dependencies first, so that WAMR
+        // finds them registered instead of calling back into the reader one
+        // by one. Modules being prepared up the stack are left to WAMR, which
+        // reports circular dependencies.
+        HeapTuple target = NULL;
+        for (uint64 i = 0; i < tuptable->numvals; i++) {
+            HeapTuple row = tuptable->vals[i];
+            char *row_name = SPI_getvalue(row, tuptable->tupdesc, 1);
+            if (strcmp(row_name, name) == 0)
+                target = row;
+            else if (!rst_lookup_module(row_name) && !is_preparing(row_name))
+                prepare_module_row(row, tuptable->tupdesc, NULL, NULL, true);
+            pfree(row_name);
         }
-        PG_CATCH(2);
-        {
-            rst_free_module(pmod);
-            SPI_freetuptable(tuptable);
-            PG_RE_THROW();
+        if (!target)
+            ereport(ERROR,
+                    errcode(ERRCODE_NO_DATA_FOUND),
+                    errmsg("module \"%s\" doesn't exist", name));
+
+        // Load the actual WASM module, the buffer must outlive the loading
+        pmod = prepare_module_row(target,
+                                  tuptable->tupdesc,
+                                  buffer,
+                                  size,
+                                  do_register);
+        if (buffer) {
+            pmod->loading_tuptable = tuptable;
+            tuptable = NULL;
         }
-        PG_END_TRY(2);
     }
     PG_FINALLY();
     {
+        SPI_freetuptable(tuptable);
+        preparing_modules = list_delete_first(preparing_modules);
         pfree(DatumGetPointer(name_datum));
         debug_query_string = NULL;
     }
@@ -137,6 +294,89 @@ rst_prepare_module(const char *name, uint8 **buffer, uint32 *size) {
     return pmod;
 }
 
+static PreparedModule *
+prepare_module_row(HeapTuple row,
+                   TupleDesc tupdesc,
+                   uint8 **buffer,
+                   uint32 *size,
+                   bool do_register) {
+    PreparedModule *pmod = NULL;
+    char *name = SPI_getvalue(row, tupdesc, 1);
+    check_module_name(name);
+
+    PG_TRY();
+    {
+        // Create the PreparedModule with all pre-compiled queries
+        bool isnull;
+        Datum datum = SPI_getbinval(row, tupdesc, 7, &isnull);
+        Assert(!isnull);
+        pmod = create_module_with_queries(name, datum);
+
+        // Take out the raw data from the row
+        datum = SPI_getbinval(row, tupdesc, 3, &isnull);
+        Assert(!isnull);
+        ArrayType *heap_types = DatumGetArrayTypeP(datum);
+        datum = SPI_getbinval(row, tupdesc, 4, &isnull);
+        Assert(!isnull);
+        uint64 hash = (uint64)DatumGetInt64(datum);
+        datum = SPI_getbinval(row, tupdesc, 5, &isnull);
+        Assert(!isnull);
+        uint32 code_size = (uint32)DatumGetInt32(datum);
+        datum = SPI_getbinval(row, tupdesc, 6, &isnull);
+        Assert(!isnull);
+        pmod->generation = DatumGetInt64(datum);
+        load_heap_types(heap_types, &pmod->heap_types);
+
+        // Map the AOT image shared by other workers or cached on disk;
+        // only fetch and decompress bin_code from the table on a miss, and
+        // cache it for next time.
+        uint8 *code;
+        uint32 code_len;
+        if (!rst_aot_cache_attach(name, hash, &pmod->image)
+            && !rst_aot_cache_open_file(hash, code_size, &pmod->image)) {
+            datum = SPI_getbinval(row, tupdesc, 2, &isnull);
+            Assert(!isnull);
+            code = rst_aot_image_unpack(name, datum, &code_len);
+            if (!rst_aot_cache_write_file(hash, code, code_len)
+                || !rst_aot_cache_open_file(hash, code_len, &pmod->image))
+                rst_aot_cache_publish(name,
+                                      hash,
+                                      code,
+                                      code_len,
+                                      &pmod->image);
+        }
+        if (pmod->image.addr) {
+            code = pmod->image.addr;
+            code_len = pmod->image.size;
+        }
+        // Load the actual WASM module, the shared image must outlive it
+        if (buffer) {
+            Assert(size != NULL);
+            *buffer = code;
+            *size = code_len;
+        }
+        else {
+            pmod->module = load_aot_module((const char *)pmod,
+                                           code,
+                                           code_len,
+                                           pmod->image.addr == NULL,
+                                           do_register);
+            // An unregistered version is accounted for once swapped in
+            if (do_register)
+                rst_module_loaded(pmod);
+        }
+    }
+    PG_CATCH();
+    {
+        rst_free_module(pmod);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    pfree(name);
+    return pmod;
+}
+
 PreparedModule *
 rst_lookup_module(const char *name) {
     wasm_module_t module = wasm_runtime_find_module_registered(name);
@@ -146,19 +386,177 @@ rst_lookup_module(const char *name) {
         return NULL;
 }
 
+static bool
+in_context_tree(void *pointer, MemoryContext mcxt) {
+    for (MemoryContext context = GetMemoryChunkContext(pointer); context;
+         context = context->parent)
+        if (context == mcxt)
+            return true;
+    return false;
+}
+
+// RTT types are created lazily in whichever module context is active, so a
+// dependency may cache RTT types allocated in the context of its importer.
+// Forget those before the context goes away, they'll be created again.
+static void
+release_foreign_rtt_types(MemoryContext mcxt) {
+    dlist_iter iter;
+    dlist_foreach(iter, &loaded_modules) {
+        PreparedModule *pmod =
+            dlist_container(PreparedModule, lru_node, iter.cur);
+        AOTModule *module = pmod->module;
+        if (!module || pmod->mcxt == mcxt)
+            continue;
+        for (uint32 i = 0; i < module->type_count; i++) {
+            WASMRttTypeRef rtt_type = module->rtt_types[i];
+            if (rtt_type && in_context_tree(rtt_type, mcxt))
+                module->rtt_types[i] = NULL;
+        }
+    }
+}
+
 void
 rst_free_module(PreparedModule *pmod) {
     if (!pmod)
         return;
+    if (!dlist_node_is_detached(&pmod->lru_node)) {
+        dlist_delete_thoroughly(&pmod->lru_node);
+        rst_worker_stats->modules--;
+        rst_worker_stats->module_bytes -= pmod->footprint;
+        rst_stats_forget_module(pmod->name);
+    }
+    for (int i = 0; i < pmod->ndeps; i++)
+        pmod->deps[i]->refcount--;
     for (int i = 0; i < pmod->nqueries; i++)
         rst_free_query_plan(&pmod->queries[i]);
     if (pmod->module) {
         wasm_runtime_unregister_module((wasm_module_t)pmod->module);
         aot_unload(pmod->module);
     }
+    release_foreign_rtt_types(pmod->mcxt);
+    rst_aot_cache_release(&pmod->image);
     if (pmod->loading_tuptable)
         SPI_freetuptable(pmod->loading_tuptable);
-    pfree(pmod);
+
+    // Everything else of the module goes away with its memory context
+    MemoryContextDelete(pmod->mcxt);
+}
+
+static void
+add_dep(PreparedModule *pmod, const char *module_name) {
+    PreparedModule *dep = rst_lookup_module(module_name);
+    if (!dep || dep == pmod)
+        return; // natives like "env"
+    for (int i = 0; i < pmod->ndeps; i++)
+        if (pmod->deps[i] == dep)
+            return;
+    pmod->deps[pmod->ndeps++] = dep;
+    dep->refcount++;
+}
+
+void
+rst_module_loaded(PreparedModule *pmod) {
+    AOTModule *module = pmod->module;
+    Assert(module != NULL);
+
+    // Dependencies are loaded and registered before their importers
+    pmod->deps = MemoryContextAllocZero(
+        pmod->mcxt,
+        sizeof(PreparedModule *)
+            * (module->import_func_count + module->import_global_count + 1));
+    for (uint32 i = 0; i < module->import_func_count; i++)
+        add_dep(pmod, module->import_funcs[i].module_name);
+    for (uint32 i = 0; i < module->import_global_count; i++)
+        add_dep(pmod, module->import_globals[i].module_name);
+
+    dlist_push_head(&loaded_modules, &pmod->lru_node);
+    rst_worker_stats->module_loads++;
+    rst_worker_stats->modules++;
+    rst_module_update_memory(pmod);
+}
+
+// Prepares all the query plans of the module and of its imports, instead of
+// leaving them to the first use
+void
+rst_module_prepare_plans(PreparedModule *pmod) {
+    for (int i = 0; i < pmod->ndeps; i++)
+        rst_module_prepare_plans(pmod->deps[i]);
+    for (int i = 0; i < pmod->nqueries; i++)
+        rst_query_plan_prepare(&pmod->queries[i]);
+    rst_module_update_memory(pmod);
+}
+
+void
+rst_module_touch(PreparedModule *pmod) {
+    dlist_move_head(&loaded_modules, &pmod->lru_node);
+}
+
+// Types keep growing as instances run, so this is called again after each
+// connection. The footprint charged to the module cache also includes the
+// mapped AOT image, which may be shared with other workers.
+void
+rst_module_update_memory(PreparedModule *pmod) {
+    Size footprint = MemoryContextMemAllocated(pmod->mcxt, true);
+    if (pmod->image.addr)
+        footprint += pmod->image.size;
+    rst_worker_stats->module_bytes += (int64)footprint - (int64)pmod->footprint;
+    pmod->footprint = footprint;
+    rst_stats_report_module_memory(
+        pmod->name,
+        MemoryContextMemAllocated(pmod->code_mcxt, false),
+        MemoryContextMemAllocated(pmod->plans_mcxt, false),
+        MemoryContextMemAllocated(pmod->types_mcxt, false),
+        footprint);
+}
+
+void
+rst_module_cache_evict(PreparedModule *keep) {
+    Size budget = (Size)rst_module_cache_size * 1024;
+
+    while (rst_worker_stats->module_bytes > budget
+           || rst_worker_stats->modules > rst_module_cache_entries) {
+        // Evicting an importer may release its dependencies in the next round
+        PreparedModule *victim = NULL;
+        dlist_iter iter;
+        dlist_reverse_foreach(iter, &loaded_modules) {
+            PreparedModule *pmod =
+                dlist_container(PreparedModule, lru_node, iter.cur);
+            if (pmod != keep && !pmod->pinned && pmod->refcount == 0) {
+                victim = pmod;
+                break;
+            }
+        }
+        if (!victim)
+            break;
+        ereport(DEBUG1, errmsg("evict module \"%s\"", victim->name));
+        rst_free_module(victim);
+        rst_worker_stats->module_evictions++;
+    }
+}
+
+static PreparedModule *
+find_importer(PreparedModule *dep) {
+    dlist_iter iter;
+    dlist_foreach(iter, &loaded_modules) {
+        PreparedModule *pmod =
+            dlist_container(PreparedModule, lru_node, iter.cur);
+        for (int i = 0; i < pmod->ndeps; i++)
+            if (pmod->deps[i] == dep)
+                return pmod;
+    }
+    return NULL;
+}
+
+void
+rst_unload_module(PreparedModule *pmod) {
+    // Unload the importers first, as they refer to the code of pmod
+    while (pmod->refcount > 0) {
+        PreparedModule *importer = find_importer(pmod);
+        if (!importer)
+            break;
+        rst_unload_module(importer);
+    }
+    rst_free_module(pmod);
 }
 
 wasm_exec_env_t
@@ -195,55 +593,85 @@ rst_module_instantiate(PreparedModule *pmod,
 }
 
 static PreparedModule *
-create_module_with_queries(Datum name) {
-    // Load pre-compiled queries
-    debug_query_string = load_module_queries_sql;
-    int ret = SPI_execute_plan(load_module_queries_plan, &name, NULL, true, 0);
-    if (ret != SPI_OK_SELECT)
-        ereport(ERROR,
-                errmsg("failed to load module queries: %s",
-                       SPI_result_code_string(ret)));
-    SPITupleTable *tuptable = SPI_tuptable;
-    Assert(tuptable->tupdesc->natts == 11);
-    debug_query_string = NULL;
+create_module_with_queries(const char *name, Datum queries) {
+    // Pre-compiled queries come as an array of rustica.queries records
+    ArrayType *array = DatumGetArrayTypeP(queries);
+    Oid elemtype = ARR_ELEMTYPE(array);
+    int16 elmlen;
+    bool elmbyval;
+    char elmalign;
+    get_typlenbyvalalign(elemtype, &elmlen, &elmbyval, &elmalign);
+    Datum *elems;
+    int nelems;
+    deconstruct_array(array,
+                      elemtype,
+                      elmlen,
+                      elmbyval,
+                      elmalign,
+                      &elems,
+                      NULL,
+                      &nelems);
+    TupleDesc tupdesc = lookup_rowtype_tupdesc(elemtype, -1);
+    Assert(tupdesc->natts == 13);
 
-    // Construct the PreparedModule in TopMemoryContext and initialize name,
-    // nqueries and all query plans in it.
-    PreparedModule *pmod;
+    // Construct the PreparedModule in its own memory context and initialize
+    // name, nqueries and all query plans in it.
+    PreparedModule *pmod = NULL;
     PG_TRY();
     {
-        pmod = (PreparedModule *)MemoryContextAllocZero(
-            TopMemoryContext,
-            sizeof(PreparedModule) + sizeof(QueryPlan) * tuptable->numvals);
+        MemoryContext mcxt = AllocSetContextCreate(TopMemoryContext,
+                                                   "rustica module",
+                                                   ALLOCSET_SMALL_SIZES);
         PG_TRY(2);
         {
-            memcpy(pmod->name, VARDATA(name), VARSIZE_ANY_EXHDR(name));
-            pmod->nqueries = (int)tuptable->numvals;
+            pmod = (PreparedModule *)MemoryContextAllocZero(
+                mcxt,
+                sizeof(PreparedModule) + sizeof(QueryPlan) * nelems);
+            pmod->mcxt = mcxt;
+            strlcpy(pmod->name, name, sizeof(pmod->name));
+            MemoryContextSetIdentifier(mcxt, pmod->name);
+            pmod->code_mcxt =
+                AllocSetContextCreate(mcxt, "code", ALLOCSET_DEFAULT_SIZES);
+            pmod->plans_mcxt =
+                AllocSetContextCreate(mcxt, "plans", ALLOCSET_SMALL_SIZES);
+            pmod->types_mcxt =
+                AllocSetContextCreate(mcxt, "types", ALLOCSET_DEFAULT_SIZES);
+            pmod->nqueries = nelems;
             bool isnull;
             for (int i = 0; i < pmod->nqueries; i++) {
-                int32 idx = DatumGetInt32(SPI_getbinval(tuptable->vals[i],
-                                                        tuptable->tupdesc,
-                                                        2,
-                                                        &isnull));
+                HeapTupleHeader header = DatumGetHeapTupleHeader(elems[i]);
+                HeapTupleData tuple;
+                tuple.t_len = HeapTupleHeaderGetDatumLength(header);
+                ItemPointerSetInvalid(&tuple.t_self);
+                tuple.t_tableOid = InvalidOid;
+                tuple.t_data = header;
+
+                int32 idx =
+                    DatumGetInt32(SPI_getbinval(&tuple, tupdesc, 2, &isnull));
                 Assert(!isnull);
                 if (i != idx)
                     ereport(ERROR,
                             errmsg("bad query index %d: expect %d", idx, i));
                 rst_init_query_plan(&pmod->queries[i],
-                                    tuptable->vals[i],
-                                    tuptable->tupdesc);
+                                    &tuple,
+                                    tupdesc,
+                                    pmod->plans_mcxt);
             }
         }
         PG_CATCH(2);
         {
-            rst_free_module(pmod);
+            if (pmod)
+                rst_free_module(pmod);
+            else
+                MemoryContextDelete(mcxt);
             PG_RE_THROW();
         }
         PG_END_TRY(2);
     }
     PG_FINALLY();
     {
-        SPI_freetuptable(tuptable);
+        ReleaseTupleDesc(tupdesc);
+        pfree(elems);
     }
     PG_END_TRY();
 
@@ -275,13 +703,19 @@ load_heap_types(ArrayType *array, CommonHeapTypes *heap_types) {
 }
 
 static AOTModule *
-load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len) {
+load_aot_module(const char *name,
+                uint8 *bin_code,
+                uint32_t bin_code_len,
+                bool freeable,
+                bool do_register) {
     DECLARE_ERROR_BUF(128);
 
     // Load the WASM module
-    LoadArgs load_args = { .name = (char *)name, .wasm_binary_freeable = true };
+    LoadArgs load_args = { .name = (char *)name,
+                           .wasm_binary_freeable = freeable };
     AOTModule *aot_module = NULL;
-    MemoryContext tx_mctx = MemoryContextSwitchTo(TopMemoryContext);
+    MemoryContext alloc_context = rst_wamr_alloc_context;
+    rst_wamr_alloc_context = ((PreparedModule *)name)->code_mcxt;
     PG_TRY();
     {
         wasm_module_t module = wasm_runtime_load_ex(bin_code,
@@ -304,20 +738,10 @@ load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len) {
 
         PG_TRY(2);
         {
-            // Due to the lazy loading of `rtt_types` objects which are
-            // allocated in the module's instantiate phase and released with
-            // popping transactional memory context, potential crashes can
-            // occur. To resolve this issue, we preload all rtt_type objects
-            // within the TopMemoryContext.
-            for (uint32 i = 0; i < aot_module->type_count; i++) {
-                if (!wasm_rtt_type_new(aot_module->types[i],
-                                       i,
-                                       aot_module->rtt_types,
-                                       aot_module->type_count,
-                                       &aot_module->rtt_type_lock))
-                    ereport(ERROR, errmsg("failed to create rtt object"));
-            }
-            if (!wasm_runtime_register_module(name, module, ERROR_BUF_PARAMS))
+            if (do_register
+                && !wasm_runtime_register_module(name,
+                                                 module,
+                                                 ERROR_BUF_PARAMS))
                 ereport(ERROR,
                         errmsg("cannot register module \"%s\": %s",
                                name,
@@ -332,7 +756,7 @@ load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len) {
     }
     PG_FINALLY();
     {
-        MemoryContextSwitchTo(tx_mctx);
+        rst_wamr_alloc_context = alloc_context;
     }
     PG_END_TRY();
 
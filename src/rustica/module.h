@@ -6,9 +6,11 @@
 
 #include "postgres.h"
 #include "executor/spi.h"
+#include "lib/ilist.h"
 
 #include "aot_runtime.h"
 
+#include "rustica/aot_cache.h"
 #include "rustica/query.h"
 #include "rustica/wamr.h"
 
@@ -17,8 +19,29 @@
 typedef struct PreparedModule {
     char name[RST_MODULE_NAME_MAXLEN + 1];
     AOTModule *module;
+    // The PreparedModule lives in mcxt, with one child context for the WAMR
+    // loader (code), one for query plans and their converters (plans), and
+    // one for WAMR allocations while running instances, mostly lazily
+    // created RTT types (types). Deleting mcxt releases the whole module.
+    MemoryContext mcxt;
+    MemoryContext code_mcxt;
+    MemoryContext plans_mcxt;
+    MemoryContext types_mcxt;
+    MemoryContext saved_alloc_context;
+    AotImage image;
     SPITupleTable *loading_tuptable;
     CommonHeapTypes heap_types;
+    int64 generation;
+
+    // Per-worker LRU of loaded modules, most recently used first. Modules
+    // imported by others are refcounted and never evicted before them.
+    dlist_node lru_node;
+    int refcount;
+    bool pinned;
+    int ndeps;
+    struct PreparedModule **deps;
+    Size footprint;
+
     int nqueries;
     QueryPlan queries[];
 } PreparedModule;
@@ -32,12 +55,33 @@ rst_module_worker_teardown();
 PreparedModule *
 rst_prepare_module(const char *name, uint8 **buffer, uint32 *size);
 
+PreparedModule *
+rst_reload_module(PreparedModule *old);
+
 PreparedModule *
 rst_lookup_module(const char *name);
 
 void
 rst_free_module(PreparedModule *pmod);
 
+void
+rst_module_loaded(PreparedModule *pmod);
+
+void
+rst_module_prepare_plans(PreparedModule *pmod);
+
+void
+rst_module_touch(PreparedModule *pmod);
+
+void
+rst_module_update_memory(PreparedModule *pmod);
+
+void
+rst_module_cache_evict(PreparedModule *keep);
+
+void
+rst_unload_module(PreparedModule *pmod);
+
 wasm_exec_env_t
 rst_module_instantiate(PreparedModule *pmod,
                        uint32 stack_size,
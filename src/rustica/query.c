@@ -2,17 +2,28 @@
 // SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
 
 #include "postgres.h"
+#include "access/htup_details.h"
 #include "executor/spi.h"
+#include "portability/instr_time.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datetime.h"
+#include "utils/json.h"
+#include "utils/jsonb.h"
+#include "utils/jsonfuncs.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/uuid.h"
 #include "tcop/utility.h"
 
 #include "wasm_runtime_common.h"
 
 #include "rustica/datatypes.h"
+#include "rustica/gucs.h"
 #include "rustica/module.h"
 #include "rustica/query.h"
+#include "rustica/result_cache.h"
+#include "rustica/stats.h"
 
 static RST_WASM_TO_PG_RET
 wasm_i32_to_pg_bool(RST_WASM_TO_PG_ARGS) {
@@ -44,13 +55,88 @@ wasm_externref_to_datum_obj(RST_WASM_TO_PG_ARGS) {
     return wasm_externref_obj_get_datum(value.gc_obj, oid);
 }
 
-static RST_WASM_TO_PG_RET
-wasm_i32_array_to_pg_int2_array(RST_WASM_TO_PG_ARGS) {
+// Takes the backing array and the length out of a MoonBit Array
+static wasm_array_obj_t
+moonbit_array_unpack(wasm_value_t value, int *len) {
     wasm_value_t val;
     wasm_struct_obj_get_field((wasm_struct_obj_t)value.gc_obj, 0, false, &val);
     wasm_array_obj_t fixed_array = (wasm_array_obj_t)val.gc_obj;
     wasm_struct_obj_get_field((wasm_struct_obj_t)value.gc_obj, 1, false, &val);
-    int len = val.i32;
+    if (val.i32 < 0 || (uint32)val.i32 > wasm_array_obj_length(fixed_array))
+        ereport(ERROR, errmsg("invalid array length %d", val.i32));
+    if ((Size)val.i32 > MaxArraySize)
+        ereport(ERROR, errmsg("array too large: %d", val.i32));
+    *len = val.i32;
+    return fixed_array;
+}
+
+// Copies the elements of a MoonBit Array into a 1-D PG array in one go, for
+// element types that have the same width and layout on both sides
+static Datum
+wasm_fixed_array_to_pg(wasm_value_t value, Oid elemtype, int elmlen) {
+    int len;
+    wasm_array_obj_t fixed_array = moonbit_array_unpack(value, &len);
+    if (len == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(elemtype));
+    Assert((1 << wasm_array_obj_elem_size_log(fixed_array)) == elmlen);
+
+    Size nbytes = ARR_OVERHEAD_NONULLS(1) + (Size)len * elmlen;
+    ArrayType *array = palloc0(nbytes);
+    SET_VARSIZE(array, nbytes);
+    array->ndim = 1;
+    array->dataoffset = 0;
+    array->elemtype = elemtype;
+    ARR_DIMS(array)[0] = len;
+    ARR_LBOUND(array)[0] = 1;
+    memcpy(ARR_DATA_PTR(array),
+           wasm_array_obj_first_elem_addr(fixed_array),
+           (Size)len * elmlen);
+    PG_RETURN_ARRAYTYPE_P(array);
+}
+
+// Builds a PG array of varlena elements from a MoonBit Array of externrefs,
+// where null references become NULL elements
+static Datum
+wasm_externref_array_to_pg(wasm_value_t value, Oid elemtype) {
+    int len;
+    wasm_array_obj_t fixed_array = moonbit_array_unpack(value, &len);
+    if (len == 0)
+        PG_RETURN_ARRAYTYPE_P(construct_empty_array(elemtype));
+
+    Datum *datum_array = palloc(sizeof(Datum) * len);
+    bool *nulls = palloc(sizeof(bool) * len);
+    wasm_value_t val;
+    for (int i = 0; i < len; i++) {
+        wasm_array_obj_get_elem(fixed_array, i, false, &val);
+        nulls[i] = val.gc_obj == NULL;
+        datum_array[i] =
+            nulls[i] ? (Datum)0
+                     : wasm_externref_obj_get_datum(val.gc_obj, elemtype);
+    }
+    int16 elmlen;
+    bool elmbyval;
+    char elmalign;
+    get_typlenbyvalalign(elemtype, &elmlen, &elmbyval, &elmalign);
+    int lbs = 1;
+    ArrayType *array = construct_md_array(datum_array,
+                                          nulls,
+                                          1,
+                                          &len,
+                                          &lbs,
+                                          elemtype,
+                                          elmlen,
+                                          elmbyval,
+                                          elmalign);
+    pfree(datum_array);
+    pfree(nulls);
+    PG_RETURN_ARRAYTYPE_P(array);
+}
+
+static RST_WASM_TO_PG_RET
+wasm_i32_array_to_pg_int2_array(RST_WASM_TO_PG_ARGS) {
+    int len;
+    wasm_array_obj_t fixed_array = moonbit_array_unpack(value, &len);
+    wasm_value_t val;
     Datum *datum_array = palloc(sizeof(Datum) * len);
     for (int i = 0; i < len; i++) {
         wasm_array_obj_get_elem(fixed_array, i, false, &val);
@@ -63,21 +149,49 @@ wasm_i32_array_to_pg_int2_array(RST_WASM_TO_PG_ARGS) {
 
 static RST_WASM_TO_PG_RET
 wasm_i32_array_to_pg_int4_array(RST_WASM_TO_PG_ARGS) {
+    return wasm_fixed_array_to_pg(value, INT4OID, sizeof(int32));
+}
+
+static RST_WASM_TO_PG_RET
+wasm_i64_array_to_pg_int8_array(RST_WASM_TO_PG_ARGS) {
+    return wasm_fixed_array_to_pg(value, INT8OID, sizeof(int64));
+}
+
+static RST_WASM_TO_PG_RET
+wasm_f64_array_to_pg_float8_array(RST_WASM_TO_PG_ARGS) {
+    return wasm_fixed_array_to_pg(value, FLOAT8OID, sizeof(float8));
+}
+
+static RST_WASM_TO_PG_RET
+wasm_i32_array_to_pg_bool_array(RST_WASM_TO_PG_ARGS) {
+    int len;
+    wasm_array_obj_t fixed_array = moonbit_array_unpack(value, &len);
     wasm_value_t val;
-    wasm_struct_obj_get_field((wasm_struct_obj_t)value.gc_obj, 0, false, &val);
-    wasm_array_obj_t fixed_array = (wasm_array_obj_t)val.gc_obj;
-    wasm_struct_obj_get_field((wasm_struct_obj_t)value.gc_obj, 1, false, &val);
-    int len = val.i32;
     Datum *datum_array = palloc(sizeof(Datum) * len);
     for (int i = 0; i < len; i++) {
         wasm_array_obj_get_elem(fixed_array, i, false, &val);
-        datum_array[i] = Int32GetDatum(val.i32);
+        datum_array[i] = BoolGetDatum(val.i32 != 0);
     }
     ArrayType *array =
-        construct_array(datum_array, len, INT4OID, sizeof(int32), true, 'i');
+        construct_array(datum_array, len, BOOLOID, sizeof(bool), true, 'c');
     PG_RETURN_ARRAYTYPE_P(array);
 }
 
+static RST_WASM_TO_PG_RET
+wasm_externref_array_to_pg_text_array(RST_WASM_TO_PG_ARGS) {
+    return wasm_externref_array_to_pg(value, TEXTOID);
+}
+
+static RST_WASM_TO_PG_RET
+wasm_externref_array_to_pg_uuid_array(RST_WASM_TO_PG_ARGS) {
+    return wasm_externref_array_to_pg(value, UUIDOID);
+}
+
+static RST_WASM_TO_PG_RET
+wasm_externref_array_to_pg_bytea_array(RST_WASM_TO_PG_ARGS) {
+    return wasm_externref_array_to_pg(value, BYTEAOID);
+}
+
 static RST_WASM_TO_PG_RET (*wasm_to_pg_funcs[])(RST_WASM_TO_PG_ARGS) = {
     wasm_i32_to_pg_bool,
     wasm_i32_to_pg_int4,
@@ -87,6 +201,12 @@ static RST_WASM_TO_PG_RET (*wasm_to_pg_funcs[])(RST_WASM_TO_PG_ARGS) = {
     wasm_externref_to_datum_obj,
     wasm_i32_array_to_pg_int2_array,
     wasm_i32_array_to_pg_int4_array,
+    wasm_i64_array_to_pg_int8_array,
+    wasm_f64_array_to_pg_float8_array,
+    wasm_i32_array_to_pg_bool_array,
+    wasm_externref_array_to_pg_text_array,
+    wasm_externref_array_to_pg_uuid_array,
+    wasm_externref_array_to_pg_bytea_array,
 };
 
 static RST_PG_TO_WASM_RET
@@ -129,26 +249,18 @@ pg_datum_to_wasm_obj(RST_PG_TO_WASM_ARGS) {
     return wasm_value;
 }
 
-static RST_PG_TO_WASM_RET
-pg_int2_array_to_wasm_i32_array(RST_PG_TO_WASM_ARGS) {
-    Datum *datum_array;
-    bool *isnull;
-    int len;
-    deconstruct_array(DatumGetArrayTypeP(value),
-                      INT2OID,
-                      2,
-                      true,
-                      's',
-                      &datum_array,
-                      &isnull,
-                      &len);
-
-    wasm_local_obj_ref_t arr_struct_ref;
+// Allocates a MoonBit Array of the given struct type with a backing array of
+// len elements, and roots it in arr_struct_ref until the caller pops it
+static wasm_array_obj_t
+moonbit_array_new(wasm_exec_env_t exec_env,
+                  wasm_ref_type_t type,
+                  int len,
+                  wasm_local_obj_ref_t *arr_struct_ref) {
     wasm_struct_obj_t arr_struct =
         wasm_struct_obj_new_with_typeidx(exec_env, type.heap_type);
-    wasm_runtime_push_local_obj_ref(exec_env, &arr_struct_ref);
+    wasm_runtime_push_local_obj_ref(exec_env, arr_struct_ref);
     wasm_obj_t arr_obj = (wasm_obj_t)arr_struct;
-    arr_struct_ref.val = arr_obj;
+    arr_struct_ref->val = arr_obj;
 
     wasm_struct_type_t struct_type =
         (wasm_struct_type_t)wasm_obj_get_defined_type(arr_obj);
@@ -164,61 +276,189 @@ pg_int2_array_to_wasm_i32_array(RST_PG_TO_WASM_ARGS) {
     wasm_struct_obj_set_field(arr_struct, 0, &val);
     val.i32 = len;
     wasm_struct_obj_set_field(arr_struct, 1, &val);
+    return fixed_array;
+}
+
+static wasm_value_t
+moonbit_array_finish(wasm_exec_env_t exec_env,
+                     wasm_local_obj_ref_t *arr_struct_ref) {
+    wasm_value_t val = { .gc_obj = arr_struct_ref->val };
+    wasm_runtime_pop_local_obj_ref(exec_env);
+    return val;
+}
+
+// Copies the elements of a PG array into a new MoonBit Array in one go, for
+// element types of the same width and layout. Like the per-element
+// converters, NULL elements are left as zeros.
+static wasm_value_t
+pg_fixed_array_to_wasm(wasm_exec_env_t exec_env,
+                       wasm_ref_type_t type,
+                       Datum value,
+                       int elmlen) {
+    ArrayType *array = DatumGetArrayTypeP(value);
+    int len = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
 
+    wasm_local_obj_ref_t arr_struct_ref;
+    wasm_array_obj_t fixed_array =
+        moonbit_array_new(exec_env, type, len, &arr_struct_ref);
+    Assert(len == 0
+           || (1 << wasm_array_obj_elem_size_log(fixed_array)) == elmlen);
+    char *dst = (char *)wasm_array_obj_first_elem_addr(fixed_array);
+    char *src = ARR_DATA_PTR(array);
+    bits8 *bitmap = ARR_NULLBITMAP(array);
+    if (!bitmap) {
+        if (len > 0)
+            memcpy(dst, src, (Size)len * elmlen);
+    }
+    else {
+        // NULLs take no space in the data area, so copy the others one by one
+        for (int i = 0; i < len; i++, dst += elmlen) {
+            if (bitmap[i / 8] & (1 << (i % 8))) {
+                memcpy(dst, src, elmlen);
+                src += elmlen;
+            }
+        }
+    }
+    RST_FREE_IF_COPY(array, value);
+    return moonbit_array_finish(exec_env, &arr_struct_ref);
+}
+
+static RST_PG_TO_WASM_RET
+pg_int2_array_to_wasm_i32_array(RST_PG_TO_WASM_ARGS) {
+    Datum *datum_array;
+    bool *isnull;
+    int len;
+    deconstruct_array(DatumGetArrayTypeP(value),
+                      INT2OID,
+                      2,
+                      true,
+                      's',
+                      &datum_array,
+                      &isnull,
+                      &len);
+
+    wasm_local_obj_ref_t arr_struct_ref;
+    wasm_array_obj_t fixed_array =
+        moonbit_array_new(exec_env, type, len, &arr_struct_ref);
+    wasm_value_t val;
     for (int i = 0; i < len; i++) {
         val.i32 = DatumGetInt16(datum_array[i]);
         wasm_array_obj_set_elem(fixed_array, i, &val);
     }
-
-    wasm_runtime_pop_local_obj_ref(exec_env);
-    val.gc_obj = arr_obj;
-    return val;
+    return moonbit_array_finish(exec_env, &arr_struct_ref);
 }
 
 static RST_PG_TO_WASM_RET
 pg_int4_array_to_wasm_i32_array(RST_PG_TO_WASM_ARGS) {
+    return pg_fixed_array_to_wasm(exec_env, type, value, sizeof(int32));
+}
+
+static RST_PG_TO_WASM_RET
+pg_int8_array_to_wasm_i64_array(RST_PG_TO_WASM_ARGS) {
+    return pg_fixed_array_to_wasm(exec_env, type, value, sizeof(int64));
+}
+
+static RST_PG_TO_WASM_RET
+pg_float8_array_to_wasm_f64_array(RST_PG_TO_WASM_ARGS) {
+    return pg_fixed_array_to_wasm(exec_env, type, value, sizeof(float8));
+}
+
+static RST_PG_TO_WASM_RET
+pg_bool_array_to_wasm_i32_array(RST_PG_TO_WASM_ARGS) {
     Datum *datum_array;
     bool *isnull;
     int len;
     deconstruct_array(DatumGetArrayTypeP(value),
-                      INT4OID,
-                      4,
+                      BOOLOID,
+                      sizeof(bool),
                       true,
-                      'i',
+                      'c',
                       &datum_array,
                       &isnull,
                       &len);
 
     wasm_local_obj_ref_t arr_struct_ref;
-    wasm_struct_obj_t arr_struct =
-        wasm_struct_obj_new_with_typeidx(exec_env, type.heap_type);
-    wasm_runtime_push_local_obj_ref(exec_env, &arr_struct_ref);
-    wasm_obj_t arr_obj = (wasm_obj_t)arr_struct;
-    arr_struct_ref.val = arr_obj;
-
-    wasm_struct_type_t struct_type =
-        (wasm_struct_type_t)wasm_obj_get_defined_type(arr_obj);
-    wasm_ref_type_t fixed_array_type =
-        wasm_struct_type_get_field_type(struct_type, 0, NULL);
     wasm_array_obj_t fixed_array =
-        wasm_array_obj_new_with_typeidx(exec_env,
-                                        fixed_array_type.heap_type,
-                                        len,
-                                        NULL);
+        moonbit_array_new(exec_env, type, len, &arr_struct_ref);
+    wasm_value_t val;
+    for (int i = 0; i < len; i++) {
+        val.i32 = DatumGetBool(datum_array[i]);
+        wasm_array_obj_set_elem(fixed_array, i, &val);
+    }
+    return moonbit_array_finish(exec_env, &arr_struct_ref);
+}
 
-    wasm_value_t val = { .gc_obj = (wasm_obj_t)fixed_array };
-    wasm_struct_obj_set_field(arr_struct, 0, &val);
-    val.i32 = len;
-    wasm_struct_obj_set_field(arr_struct, 1, &val);
+// Wraps each element of a PG array of by-reference values in a datum object,
+// which refers to the element in place; NULL elements become null references
+static wasm_value_t
+pg_byref_array_to_wasm(wasm_exec_env_t exec_env,
+                       wasm_ref_type_t type,
+                       Datum value,
+                       wasm_obj_t tuple_obj,
+                       Oid elemtype,
+                       int elmlen,
+                       char elmalign) {
+    Datum *datum_array;
+    bool *isnull;
+    int len;
+    deconstruct_array(DatumGetArrayTypeP(value),
+                      elemtype,
+                      elmlen,
+                      false,
+                      elmalign,
+                      &datum_array,
+                      &isnull,
+                      &len);
 
+    wasm_local_obj_ref_t arr_struct_ref;
+    wasm_array_obj_t fixed_array =
+        moonbit_array_new(exec_env, type, len, &arr_struct_ref);
+    wasm_value_t val;
     for (int i = 0; i < len; i++) {
-        val.i32 = DatumGetInt32(datum_array[i]);
+        if (isnull[i])
+            val.gc_obj = NULL;
+        else
+            val = pg_datum_to_wasm_obj(datum_array[i],
+                                       tuple_obj,
+                                       elemtype,
+                                       exec_env,
+                                       type);
         wasm_array_obj_set_elem(fixed_array, i, &val);
     }
+    return moonbit_array_finish(exec_env, &arr_struct_ref);
+}
 
-    wasm_runtime_pop_local_obj_ref(exec_env);
-    val.gc_obj = arr_obj;
-    return val;
+static RST_PG_TO_WASM_RET
+pg_text_array_to_wasm_externref_array(RST_PG_TO_WASM_ARGS) {
+    return pg_byref_array_to_wasm(exec_env,
+                                  type,
+                                  value,
+                                  tuple_obj,
+                                  TEXTOID,
+                                  -1,
+                                  'i');
+}
+
+static RST_PG_TO_WASM_RET
+pg_uuid_array_to_wasm_externref_array(RST_PG_TO_WASM_ARGS) {
+    return pg_byref_array_to_wasm(exec_env,
+                                  type,
+                                  value,
+                                  tuple_obj,
+                                  UUIDOID,
+                                  UUID_LEN,
+                                  'c');
+}
+
+static RST_PG_TO_WASM_RET
+pg_bytea_array_to_wasm_externref_array(RST_PG_TO_WASM_ARGS) {
+    return pg_byref_array_to_wasm(exec_env,
+                                  type,
+                                  value,
+                                  tuple_obj,
+                                  BYTEAOID,
+                                  -1,
+                                  'i');
 }
 
 static RST_PG_TO_WASM_RET (*pg_to_wasm_funcs[])(RST_PG_TO_WASM_ARGS) = {
@@ -230,34 +470,197 @@ static RST_PG_TO_WASM_RET (*pg_to_wasm_funcs[])(RST_PG_TO_WASM_ARGS) = {
     pg_datum_to_wasm_obj,
     pg_int2_array_to_wasm_i32_array,
     pg_int4_array_to_wasm_i32_array,
+    pg_int8_array_to_wasm_i64_array,
+    pg_float8_array_to_wasm_f64_array,
+    pg_bool_array_to_wasm_i32_array,
+    pg_text_array_to_wasm_externref_array,
+    pg_uuid_array_to_wasm_externref_array,
+    pg_bytea_array_to_wasm_externref_array,
 };
 
+static ScalarKind
+wasm_to_pg_scalar_kind(WASM2PGFunc func) {
+    if (func == wasm_i32_to_pg_bool)
+        return SCALAR_BOOL;
+    if (func == wasm_i32_to_pg_int4)
+        return SCALAR_INT4;
+    if (func == wasm_i64_to_pg_int8)
+        return SCALAR_INT8;
+    if (func == wasm_f32_to_pg_float4)
+        return SCALAR_FLOAT4;
+    if (func == wasm_f64_to_pg_float8)
+        return SCALAR_FLOAT8;
+    return SCALAR_NONE;
+}
+
+static ScalarKind
+pg_to_wasm_scalar_kind(PG2WASMFunc func) {
+    if (func == pg_bool_to_wasm_i32)
+        return SCALAR_BOOL;
+    if (func == pg_int4_to_wasm_i32)
+        return SCALAR_INT4;
+    if (func == pg_int8_to_wasm_i64)
+        return SCALAR_INT8;
+    if (func == pg_float4_to_wasm_f32)
+        return SCALAR_FLOAT4;
+    if (func == pg_float8_to_wasm_f64)
+        return SCALAR_FLOAT8;
+    return SCALAR_NONE;
+}
+
+// Field offsets only depend on the struct type, which is the same for all
+// instances of the module, so they are resolved once per plan. Like in
+// wasm_struct_obj_get_field(), they count from the start of the object.
+static void
+resolve_field_offsets(wasm_struct_obj_t obj, uint32 *offsets, uint32 count) {
+    WASMStructType *type =
+        (WASMStructType *)wasm_obj_get_defined_type((wasm_obj_t)obj);
+    if (type->field_count < count)
+        ereport(ERROR,
+                errmsg("struct has %d fields but %u were compiled",
+                       type->field_count,
+                       count));
+    for (uint32 i = 0; i < count; i++)
+        offsets[i] = type->fields[i].field_offset;
+}
+
+static inline Datum
+scalar_to_datum(ScalarKind kind, const uint8 *field) {
+    switch (kind) {
+        case SCALAR_BOOL:
+        case SCALAR_INT4: {
+            int32 v;
+            memcpy(&v, field, sizeof(v));
+            return kind == SCALAR_BOOL ? BoolGetDatum(v ? true : false)
+                                       : Int32GetDatum(v);
+        }
+        case SCALAR_INT8: {
+            int64 v;
+            memcpy(&v, field, sizeof(v));
+            return Int64GetDatum(v);
+        }
+        case SCALAR_FLOAT4: {
+            float4 v;
+            memcpy(&v, field, sizeof(v));
+            return Float4GetDatum(v);
+        }
+        case SCALAR_FLOAT8: {
+            float8 v;
+            memcpy(&v, field, sizeof(v));
+            return Float8GetDatum(v);
+        }
+        default:
+            pg_unreachable();
+    }
+}
+
+static inline void
+datum_to_scalar(ScalarKind kind, Datum value, bool isnull, uint8 *field) {
+    switch (kind) {
+        case SCALAR_BOOL:
+        case SCALAR_INT4: {
+            int32 v = isnull                ? 0
+                      : kind == SCALAR_BOOL ? DatumGetBool(value)
+                                            : DatumGetInt32(value);
+            memcpy(field, &v, sizeof(v));
+            break;
+        }
+        case SCALAR_INT8: {
+            int64 v = isnull ? 0 : DatumGetInt64(value);
+            memcpy(field, &v, sizeof(v));
+            break;
+        }
+        case SCALAR_FLOAT4: {
+            float4 v = isnull ? 0 : DatumGetFloat4(value);
+            memcpy(field, &v, sizeof(v));
+            break;
+        }
+        case SCALAR_FLOAT8: {
+            float8 v = isnull ? 0 : DatumGetFloat8(value);
+            memcpy(field, &v, sizeof(v));
+            break;
+        }
+        default:
+            pg_unreachable();
+    }
+}
+
 void
 rst_free_query_plan(QueryPlan *plan) {
-    if (!plan)
+    if (!plan || !plan->sql)
         return;
     if (plan->plan) {
         ereport(DEBUG2, errmsg("SPI_freeplan"));
         SPI_freeplan(plan->plan);
+        rst_worker_stats->plans_prepared--;
     }
-    if (plan->wasm_to_pg_funcs)
-        pfree(plan->wasm_to_pg_funcs);
-    // GOTCHA: plan->pg_to_wasm_funcs, plan->ret_field_types and plan->argtypes
-    // all live in the same memory allocation.
+    rst_worker_stats->plans_total--;
+    // The rest is released along with the plans context of the module
+    plan->sql = NULL;
+}
+
+SPIPlanPtr
+rst_query_plan_prepare(QueryPlan *plan) {
+    if (plan->plan)
+        return plan->plan;
+
+    SPIPlanPtr spi_plan = NULL;
+    debug_query_string = plan->sql;
+    PG_TRY();
+    {
+        spi_plan = SPI_prepare(plan->sql, (int)plan->nargs, plan->argtypes);
+        if (!spi_plan)
+            ereport(ERROR,
+                    errmsg("failed to prepare statement: %s",
+                           SPI_result_code_string(SPI_result)));
+
+        // The result shape was recorded at compile time, check it still holds
+        List *source_list = SPI_plan_get_plan_sources(spi_plan);
+        Assert(list_length(source_list) == 1);
+        CachedPlanSource *source = ((CachedPlanSource *)linitial(source_list));
+        int nattrs = source->resultDesc ? source->resultDesc->natts : 0;
+        if (nattrs != plan->nattrs)
+            ereport(ERROR,
+                    errmsg("statement returns %d columns but %d were compiled",
+                           nattrs,
+                           plan->nattrs));
+        if (SPI_keepplan(spi_plan))
+            ereport(ERROR, errmsg("failed to keep plan"));
+    }
+    PG_CATCH();
+    {
+        debug_query_string = NULL;
+        if (spi_plan)
+            SPI_freeplan(spi_plan);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    debug_query_string = NULL;
+    plan->plan = spi_plan;
+    rst_worker_stats->plans_prepared++;
+    return spi_plan;
 }
 
 void
-rst_init_query_plan(QueryPlan *plan, HeapTuple query_tup, TupleDesc tupdesc) {
+rst_init_query_plan(QueryPlan *plan,
+                    HeapTuple query_tup,
+                    TupleDesc tupdesc,
+                    MemoryContext mcxt) {
     bool isnull;
     Datum datum;
 
-    // Take the SQL text
+    // Take the SQL text, the plan itself is only prepared on first use unless
+    // the query is marked as hot.
     datum = SPI_getbinval(query_tup, tupdesc, 3, &isnull);
     Assert(!isnull);
-    text *sql_text = DatumGetTextPP(datum);
-    char *sql = VARDATA_ANY(sql_text);
-
-    debug_query_string = sql;
+    plan->sql = MemoryContextStrdup(mcxt, TextDatumGetCString(datum));
+    rst_worker_stats->plans_total++;
+    datum = SPI_getbinval(query_tup, tupdesc, 12, &isnull);
+    plan->hot = !isnull && DatumGetBool(datum);
+    datum = SPI_getbinval(query_tup, tupdesc, 13, &isnull);
+    plan->cache_ttl = isnull ? 0 : DatumGetInt32(datum);
+
+    debug_query_string = plan->sql;
     PG_TRY();
     {
         // Take argument OIDs
@@ -280,21 +683,11 @@ rst_init_query_plan(QueryPlan *plan, HeapTuple query_tup, TupleDesc tupdesc) {
         }
         pfree(datum_array);
 
-        // Create SPI query plan
-        SPIPlanPtr spi_plan = SPI_prepare(sql, (int)nargs, argtypes);
-        if (!spi_plan)
-            ereport(ERROR,
-                    errmsg("failed to prepare statement: %s",
-                           SPI_result_code_string(SPI_result)));
-        if (SPI_keepplan(spi_plan))
-            ereport(ERROR, errmsg("failed to keep plan"));
-        plan->plan = spi_plan;
-        List *source_list = SPI_plan_get_plan_sources(spi_plan);
-        Assert(list_length(source_list) == 1);
-        CachedPlanSource *source = ((CachedPlanSource *)linitial(source_list));
-        int nattrs = 0;
-        if (source->resultDesc)
-            nattrs = source->resultDesc->natts;
+        // Take the number of result columns described at compile time
+        datum = SPI_getbinval(query_tup, tupdesc, 9, &isnull);
+        Assert(!isnull);
+        ArrayType *ret_oids = DatumGetArrayTypeP(datum);
+        int nattrs = ArrayGetNItems(ARR_NDIM(ret_oids), ARR_DIMS(ret_oids));
 
         // Prepare argument converters
         datum = SPI_getbinval(query_tup, tupdesc, 7, &isnull);
@@ -317,7 +710,7 @@ rst_init_query_plan(QueryPlan *plan, HeapTuple query_tup, TupleDesc tupdesc) {
                     nargs));
         if (nargs + nattrs > 0) {
             plan->wasm_to_pg_funcs = (WASM2PGFunc *)MemoryContextAlloc(
-                TopMemoryContext,
+                mcxt,
                 sizeof(void *) * (nargs + nattrs)
                     + sizeof(wasm_ref_type_t) * nattrs
                     + sizeof(Oid) * (nargs + nattrs));
@@ -432,6 +825,33 @@ rst_init_query_plan(QueryPlan *plan, HeapTuple query_tup, TupleDesc tupdesc) {
         }
         pfree(datum_array);
         plan->nattrs = nattrs;
+
+        // Look for scalar-only fast paths
+        if (nargs + nattrs > 0) {
+            plan->arg_offsets = MemoryContextAllocZero(
+                mcxt,
+                (sizeof(uint32) + sizeof(uint8)) * (nargs + nattrs));
+            plan->ret_offsets = plan->arg_offsets + nargs;
+            plan->arg_kinds = (uint8 *)(plan->arg_offsets + nargs + nattrs);
+            plan->ret_kinds = plan->arg_kinds + nargs;
+        }
+        plan->scalar_args = nargs > 0;
+        for (int i = 0; i < nargs; i++) {
+            plan->arg_kinds[i] =
+                wasm_to_pg_scalar_kind(plan->wasm_to_pg_funcs[i]);
+            if (plan->arg_kinds[i] == SCALAR_NONE)
+                plan->scalar_args = false;
+        }
+        plan->scalar_rets = nattrs > 0;
+        for (int i = 0; i < nattrs; i++) {
+            plan->ret_kinds[i] =
+                pg_to_wasm_scalar_kind(plan->pg_to_wasm_funcs[i]);
+            if (plan->ret_kinds[i] == SCALAR_NONE)
+                plan->scalar_rets = false;
+        }
+
+        if (plan->hot)
+            rst_query_plan_prepare(plan);
     }
     PG_FINALLY();
     {
@@ -471,32 +891,244 @@ rst_free_instance_context(wasm_exec_env_t exec_env) {
     pfree(ctx->anyref_array->defined_type);
 }
 
-static int32_t
-env_execute_statement(wasm_exec_env_t exec_env, int32_t idx) {
-    ereport(DEBUG1, (errmsg("execute sql: #%d", idx)));
-
-    // Take out the QueryPlan
-    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+static QueryPlan *
+lookup_query_plan(Context *ctx, int32_t idx) {
     if (idx < 0 || idx >= ctx->module->nqueries)
         ereport(ERROR, errmsg("no such query: #%d", idx));
-    QueryPlan *plan = ctx->module->queries + idx;
+    return ctx->module->queries + idx;
+}
 
-    // Read out user's query arguments
+// Returns the argument struct of the query held by the guest
+static wasm_struct_obj_t
+query_args(Context *ctx, int32_t idx) {
     wasm_value_t val;
     wasm_struct_obj_get_field(ctx->queries, idx, false, &val);
     wasm_struct_obj_t query = (wasm_struct_obj_t)val.gc_obj;
     wasm_struct_obj_get_field(query, 3, false, &val);
-    wasm_struct_obj_t args = (wasm_struct_obj_t)val.gc_obj;
+    return (wasm_struct_obj_t)val.gc_obj;
+}
+
+// Accounts the time since start and the rows to the query, with ncalls
+// executions in it
+static void
+query_stat_add(QueryPlan *plan, instr_time start, uint64 rows, uint32 ncalls) {
+    instr_time duration;
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    double ms = INSTR_TIME_GET_MILLISEC(duration);
+    plan->stat_total_time += ms;
+    plan->stat_rows += rows;
+    if (ncalls > 0) {
+        plan->stat_calls += ncalls;
+        plan->stat_max_time = Max(plan->stat_max_time, ms / ncalls);
+    }
+}
+
+// Accounts the time since start to the conversion time of the query
+static void
+query_stat_conv(QueryPlan *plan, instr_time start) {
+    instr_time duration;
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    plan->stat_conv_time += INSTR_TIME_GET_MILLISEC(duration);
+}
+
+static void
+lower_args(wasm_exec_env_t exec_env,
+           QueryPlan *plan,
+           wasm_struct_obj_t args,
+           Datum *values) {
+    instr_time start;
+    INSTR_TIME_SET_CURRENT(start);
+    if (plan->scalar_args) {
+        if (!plan->arg_offsets_ready) {
+            resolve_field_offsets(args, plan->arg_offsets, plan->nargs);
+            plan->arg_offsets_ready = true;
+        }
+        uint8 *data = (uint8 *)args;
+        for (uint32 i = 0; i < plan->nargs; i++)
+            values[i] = scalar_to_datum((ScalarKind)plan->arg_kinds[i],
+                                        data + plan->arg_offsets[i]);
+    }
+    else {
+        wasm_value_t val;
+        for (uint32 i = 0; i < plan->nargs; i++) {
+            wasm_struct_obj_get_field(args, i, false, &val);
+            values[i] =
+                plan->wasm_to_pg_funcs[i](exec_env, plan->argtypes[i], val);
+        }
+    }
+    query_stat_conv(plan, start);
+}
+
+static int32_t
+env_execute_statement(wasm_exec_env_t exec_env, int32_t idx) {
+    ereport(DEBUG1, (errmsg("execute sql: #%d", idx)));
+
+    // Take out the QueryPlan and read out user's query arguments
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    QueryPlan *plan = lookup_query_plan(ctx, idx);
+    instr_time start;
+    INSTR_TIME_SET_CURRENT(start);
+    Datum values[plan->nargs];
+    lower_args(exec_env, plan, query_args(ctx, idx), values);
+
+    // Execute the query, returning the number of rows processed
+    SPIPlanPtr spi_plan = rst_query_plan_prepare(plan);
+    int ret = SPI_execute_plan(spi_plan, values, NULL, false, 0);
+    if (ret < 0)
+        ereport(ERROR,
+                errmsg("failed to execute statement: %s",
+                       SPI_result_code_string(ret)));
+    rst_result_cache_note_writes(plan, spi_plan);
+    plan->calls++;
+    query_stat_add(plan, start, SPI_processed, 1);
+    SPI_freetuptable(SPI_tuptable);
+    if (SPI_processed > INT_MAX)
+        ereport(ERROR, errmsg("too many rows"));
+    return (int32_t)SPI_processed;
+}
+
+// Like execute_statement, but keeps the rows of the statement, including
+// INSERT/UPDATE/DELETE ... RETURNING, as a tuple table for tuple_lower.
+static wasm_externref_obj_t
+env_execute_returning(wasm_exec_env_t exec_env, int32_t idx) {
+    ereport(DEBUG1, (errmsg("execute returning: #%d", idx)));
 
-    // Execute the query
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    QueryPlan *plan = lookup_query_plan(ctx, idx);
+    instr_time start;
+    INSTR_TIME_SET_CURRENT(start);
     Datum values[plan->nargs];
-    for (uint32 i = 0; i < plan->nargs; i++) {
-        wasm_struct_obj_get_field(args, i, false, &val);
-        values[i] = plan->wasm_to_pg_funcs[i](exec_env, plan->argtypes[i], val);
+    lower_args(exec_env, plan, query_args(ctx, idx), values);
+
+    SPIPlanPtr spi_plan = rst_query_plan_prepare(plan);
+    ResultCacheProbe probe;
+    bool cacheable = rst_result_cache_probe(&probe,
+                                            ctx->module,
+                                            idx,
+                                            plan,
+                                            spi_plan,
+                                            values);
+    SPITupleTable *cached = cacheable ? rst_result_cache_get(&probe) : NULL;
+    if (cached) {
+        pfree(probe.args.data);
+        // Served from the result cache, skipping the executor
+        uint64 ntuples = cached->numvals;
+        plan->calls++;
+        plan->stat_cache_hits++;
+        query_stat_add(plan, start, ntuples, 1);
+
+        obj_t rv = rst_obj_new(exec_env, OBJ_TUPLE_TABLE, NULL, 0);
+        rv->query_idx = idx;
+        if (ntuples == 0) {
+            MemoryContextDelete(cached->tuptabcxt);
+            rv->body.tuptable = NULL;
+        }
+        else {
+            rv->flags |= OBJ_OWNS_BODY | OBJ_CACHED_BODY;
+            rv->body.tuptable = cached;
+        }
+        return rst_externref_of_obj(exec_env, rv);
     }
-    SPI_execute_plan(plan->plan, values, NULL, false, 0);
 
-    return 1;
+    int ret = SPI_execute_plan(spi_plan, values, NULL, false, 0);
+    if (ret < 0)
+        ereport(ERROR,
+                errmsg("failed to execute statement: %s",
+                       SPI_result_code_string(ret)));
+    rst_result_cache_note_writes(plan, spi_plan);
+    plan->calls++;
+    query_stat_add(plan, start, SPI_processed, 1);
+    if (cacheable) {
+        if (SPI_tuptable != NULL && SPI_processed <= INT_MAX)
+            rst_result_cache_put(&probe, SPI_tuptable, SPI_processed);
+        pfree(probe.args.data);
+    }
+
+    obj_t rv = rst_obj_new(exec_env, OBJ_TUPLE_TABLE, NULL, 0);
+    rv->query_idx = idx;
+    if (SPI_tuptable == NULL || SPI_processed == 0) {
+        SPI_freetuptable(SPI_tuptable);
+        rv->body.tuptable = NULL;
+    }
+    else if (SPI_processed > INT_MAX) {
+        SPI_freetuptable(SPI_tuptable);
+        ereport(ERROR, errmsg("too many rows"));
+    }
+    else {
+        rv->flags |= OBJ_OWNS_BODY;
+        rv->body.tuptable = SPI_tuptable;
+    }
+    return rst_externref_of_obj(exec_env, rv);
+}
+
+// Executes the query once for each argument struct in the batch array, all
+// converted upfront, and returns the total number of rows processed.
+static int32_t
+env_execute_batch(wasm_exec_env_t exec_env, int32_t idx, wasm_obj_t batch_ref) {
+    ereport(DEBUG1, (errmsg("execute batch: #%d", idx)));
+
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    QueryPlan *plan = lookup_query_plan(ctx, idx);
+    if (!batch_ref || wasm_obj_is_externref_obj(batch_ref)
+        || !wasm_obj_is_array_obj(batch_ref))
+        ereport(ERROR, errmsg("expected an array of query arguments"));
+    wasm_array_obj_t batch = (wasm_array_obj_t)batch_ref;
+    uint32 nrows = wasm_array_obj_length(batch);
+    if (nrows == 0)
+        return 0;
+    instr_time start;
+    INSTR_TIME_SET_CURRENT(start);
+
+    // Rows must be of the argument struct type of the query, as the field
+    // offsets and conversions of the plan are resolved for that type
+    uint32 nargs = plan->nargs;
+    wasm_defined_type_t args_type = NULL;
+    if (nargs > 0) {
+        wasm_struct_obj_t args = query_args(ctx, idx);
+        if (!args)
+            ereport(ERROR, errmsg("missing query arguments of #%d", idx));
+        args_type = wasm_obj_get_defined_type((wasm_obj_t)args);
+    }
+
+    // Convert all rows before running anything, so that a bad row doesn't
+    // leave the batch half-executed
+    Datum *values = palloc(sizeof(Datum) * Max(nargs, 1) * nrows);
+    for (uint32 row = 0; row < nrows; row++) {
+        wasm_value_t val;
+        wasm_array_obj_get_elem(batch, row, false, &val);
+        if (!val.gc_obj || !wasm_obj_is_struct_obj(val.gc_obj)
+            || (args_type
+                && wasm_obj_get_defined_type(val.gc_obj) != args_type))
+            ereport(ERROR, errmsg("bad query arguments at #%u", row));
+        lower_args(exec_env,
+                   plan,
+                   (wasm_struct_obj_t)val.gc_obj,
+                   values + row * nargs);
+    }
+
+    // Run the same prepared plan back to back, dropping any RETURNING rows
+    SPIPlanPtr spi_plan = rst_query_plan_prepare(plan);
+    uint64 processed = 0;
+    for (uint32 row = 0; row < nrows; row++) {
+        int ret =
+            SPI_execute_plan(spi_plan, values + row * nargs, NULL, false, 0);
+        if (ret < 0)
+            ereport(ERROR,
+                    errmsg("failed to execute batch: %s",
+                           SPI_result_code_string(ret)));
+        processed += SPI_processed;
+        SPI_freetuptable(SPI_tuptable);
+    }
+    rst_result_cache_note_writes(plan, spi_plan);
+    plan->calls += nrows;
+    query_stat_add(plan, start, processed, nrows);
+    pfree(values);
+
+    if (processed > INT_MAX)
+        ereport(ERROR, errmsg("too many rows"));
+    return (int32_t)processed;
 }
 
 static wasm_externref_obj_t
@@ -505,41 +1137,97 @@ env_cursor_open(wasm_exec_env_t exec_env, int32_t idx) {
 
     // Take out the QueryPlan
     Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
-    if (idx < 0 || idx >= ctx->module->nqueries)
-        ereport(ERROR, errmsg("no such query: #%d", idx));
-    QueryPlan *plan = ctx->module->queries + idx;
-    if (!SPI_is_cursor_plan(plan->plan))
+    QueryPlan *plan = lookup_query_plan(ctx, idx);
+    instr_time start;
+    INSTR_TIME_SET_CURRENT(start);
+    SPIPlanPtr spi_plan = rst_query_plan_prepare(plan);
+    if (!SPI_is_cursor_plan(spi_plan))
         ereport(ERROR, errmsg("not a cursor plan"));
 
-    // Read out user's query arguments
-    wasm_value_t val;
-    wasm_struct_obj_get_field(ctx->queries, idx, false, &val);
-    wasm_struct_obj_t query = (wasm_struct_obj_t)val.gc_obj;
-    wasm_struct_obj_get_field(query, 3, false, &val);
-    wasm_struct_obj_t args = (wasm_struct_obj_t)val.gc_obj;
-
-    // Execute the query
+    // Read out user's query arguments and execute the query
     Datum values[plan->nargs];
-    for (uint32 i = 0; i < plan->nargs; i++) {
-        wasm_struct_obj_get_field(args, i, false, &val);
-        values[i] = plan->wasm_to_pg_funcs[i](exec_env, plan->argtypes[i], val);
-    }
-    Portal portal = SPI_cursor_open(NULL, plan->plan, values, NULL, false);
-    obj_t rv = rst_obj_new(exec_env, OBJ_PORTAL, NULL, 0);
-    rv->flags |= OBJ_OWNS_BODY;
-    rv->body.portal = portal;
+    lower_args(exec_env, plan, query_args(ctx, idx), values);
+    Portal portal = SPI_cursor_open(NULL, spi_plan, values, NULL, false);
+    rst_result_cache_note_writes(plan, spi_plan);
+    plan->calls++;
+    query_stat_add(plan, start, 0, 1);
+    obj_t rv =
+        rst_obj_new(exec_env, OBJ_PORTAL, NULL, strlen(portal->name) + 1);
+    strcpy(rv->body.portal_name, portal->name);
     rv->query_idx = idx;
     return rst_externref_of_obj(exec_env, rv);
 }
 
+#define FETCH_EWMA_WEIGHT 0.25
+
+// Batch size of the next adaptive fetch of the query
+static long
+adaptive_fetch_rows(QueryPlan *plan) {
+    long rows = plan->fetch_rows > 0 ? plan->fetch_rows : rst_fetch_min_rows;
+    return Min(Max(rows, rst_fetch_min_rows), rst_fetch_max_rows);
+}
+
+// Fetches an adaptive batch from the portal and folds the observed row size
+// and latency into the averages of the query. The next batch size is what
+// fits both the memory and the latency target, grown at most 2x at a time.
+// Returns the number of rows asked for.
+static long
+adaptive_fetch(QueryPlan *plan, Portal portal) {
+    long rows = adaptive_fetch_rows(plan);
+    instr_time start, duration;
+    INSTR_TIME_SET_CURRENT(start);
+    SPI_cursor_fetch(portal, true, rows);
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    if (SPI_processed == 0)
+        return rows;
+
+    uint64 bytes = 0;
+    for (uint64 i = 0; i < SPI_processed; i++)
+        bytes += HEAPTUPLESIZE + SPI_tuptable->vals[i]->t_len;
+    double row_bytes = (double)bytes / SPI_processed;
+    double row_usecs = INSTR_TIME_GET_MICROSEC(duration) / SPI_processed;
+    if (plan->fetch_rows == 0) {
+        plan->fetch_row_bytes = row_bytes;
+        plan->fetch_row_usecs = row_usecs;
+    }
+    else {
+        plan->fetch_row_bytes +=
+            FETCH_EWMA_WEIGHT * (row_bytes - plan->fetch_row_bytes);
+        plan->fetch_row_usecs +=
+            FETCH_EWMA_WEIGHT * (row_usecs - plan->fetch_row_usecs);
+    }
+
+    double next = (double)rst_fetch_target_bytes * 1024
+                  / Max(plan->fetch_row_bytes, 1.0);
+    if (rst_fetch_target_latency > 0 && plan->fetch_row_usecs > 0)
+        next = Min(next,
+                   rst_fetch_target_latency * 1000.0 / plan->fetch_row_usecs);
+    // A short batch means the portal ran dry, don't judge the growth by it
+    if ((long)SPI_processed == rows)
+        next = Min(next, rows * 2.0);
+    next = Min(next, (double)rst_fetch_max_rows);
+    plan->fetch_rows = Max((long)next, rst_fetch_min_rows);
+    return rows;
+}
+
+// Fetches count rows, or an adaptive batch if count is 0 or negative
 static wasm_externref_obj_t
-env_cursor_fetch(wasm_exec_env_t exec_env, wasm_obj_t cursor_ref, long count) {
+cursor_fetch(wasm_exec_env_t exec_env, wasm_obj_t cursor_ref, long count) {
     obj_t obj = wasm_externref_obj_get_obj(cursor_ref, OBJ_PORTAL);
-    Portal portal = obj->body.portal;
+    Portal portal = rst_obj_get_portal(obj);
     if (!PortalIsValid(portal))
         ereport(ERROR, errmsg("portal already closed"));
 
-    SPI_cursor_fetch(portal, true, count);
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    QueryPlan *plan = ctx->module->queries + obj->query_idx;
+    instr_time start;
+    INSTR_TIME_SET_CURRENT(start);
+    if (count > 0)
+        SPI_cursor_fetch(portal, true, count);
+    else
+        adaptive_fetch(plan, portal);
+    query_stat_add(plan, start, SPI_processed, 0);
     obj_t rv = rst_obj_new(exec_env, OBJ_TUPLE_TABLE, NULL, 0);
     rv->query_idx = obj->query_idx;
     if (SPI_processed == 0) {
@@ -555,19 +1243,26 @@ env_cursor_fetch(wasm_exec_env_t exec_env, wasm_obj_t cursor_ref, long count) {
     return rst_externref_of_obj(exec_env, rv);
 }
 
+// The count is an i32, sign-extended here so that negatives stay adaptive
+static wasm_externref_obj_t
+env_cursor_fetch(wasm_exec_env_t exec_env,
+                 wasm_obj_t cursor_ref,
+                 int32_t count) {
+    return cursor_fetch(exec_env, cursor_ref, (long)count);
+}
+
 static wasm_externref_obj_t
 env_cursor_fetch_all(wasm_exec_env_t exec_env, wasm_obj_t cursor_ref) {
-    return env_cursor_fetch(exec_env, cursor_ref, FETCH_ALL);
+    return cursor_fetch(exec_env, cursor_ref, FETCH_ALL);
 }
 
 static int32_t
 env_cursor_close(wasm_exec_env_t exec_env, wasm_obj_t cursor_ref) {
     obj_t obj = wasm_externref_obj_get_obj(cursor_ref, OBJ_PORTAL);
-    Portal portal = obj->body.portal;
-    if (PortalIsValid(portal)) {
+    Portal portal = rst_obj_get_portal(obj);
+    if (PortalIsValid(portal))
         SPI_cursor_close(portal);
-        obj->body.portal = NULL;
-    }
+    obj->body.portal_name = NULL;
     return 1;
 }
 
@@ -598,6 +1293,52 @@ env_tuple_table_get(wasm_exec_env_t exec_env,
     return rst_externref_of_obj(exec_env, rv);
 }
 
+// Fills the fields of a row struct, owner keeps the tuple memory alive for
+// the datums referenced by the fields. The tuple is deformed once into the
+// caller's values/nulls arrays of tupdesc->natts entries, which can be
+// reused across rows; NULLs become zero values or null references.
+static void
+lower_row(wasm_exec_env_t exec_env,
+          QueryPlan *plan,
+          TupleDesc tupdesc,
+          HeapTuple tuple,
+          wasm_obj_t owner,
+          wasm_struct_obj_t ret,
+          Datum *values,
+          bool *nulls) {
+    instr_time start;
+    INSTR_TIME_SET_CURRENT(start);
+    heap_deform_tuple(tuple, tupdesc, values, nulls);
+    if (plan->scalar_rets) {
+        if (!plan->ret_offsets_ready) {
+            resolve_field_offsets(ret, plan->ret_offsets, plan->nattrs);
+            plan->ret_offsets_ready = true;
+        }
+        uint8 *data = (uint8 *)ret;
+        for (uint32 i = 0; i < plan->nattrs; i++)
+            datum_to_scalar((ScalarKind)plan->ret_kinds[i],
+                            values[i],
+                            nulls[i],
+                            data + plan->ret_offsets[i]);
+    }
+    else {
+        for (uint32 i = 0; i < plan->nattrs; i++) {
+            wasm_value_t col_value;
+            if (nulls[i])
+                memset(&col_value, 0, sizeof(col_value));
+            else
+                col_value =
+                    plan->pg_to_wasm_funcs[i](values[i],
+                                              owner,
+                                              plan->rettypes[i],
+                                              exec_env,
+                                              plan->ret_field_types[i]);
+            wasm_struct_obj_set_field(ret, i, &col_value);
+        }
+    }
+    query_stat_conv(plan, start);
+}
+
 static int32_t
 env_tuple_lower(wasm_exec_env_t exec_env, wasm_obj_t tuple_ref) {
     obj_t obj = wasm_externref_obj_get_obj(tuple_ref, OBJ_HEAP_TUPLE);
@@ -625,32 +1366,537 @@ env_tuple_lower(wasm_exec_env_t exec_env, wasm_obj_t tuple_ref) {
     wasm_struct_obj_set_field(box, 0, &row_value);
 
     // Fill the result value fields
-    bool isnull;
     TupleDesc tupdesc = tuptable_obj->body.tuptable->tupdesc;
-    HeapTuple tuple = obj->body.tuple;
-    for (uint32 i = 0; i < plan->nattrs; i++) {
-        Datum binval = SPI_getbinval(tuple, tupdesc, (int)i + 1, &isnull);
-        wasm_value_t col_value =
-            plan->pg_to_wasm_funcs[i](binval,
-                                      tuple_ref,
-                                      plan->rettypes[i],
-                                      exec_env,
-                                      plan->ret_field_types[i]);
-        wasm_struct_obj_set_field(ret, i, &col_value);
-    }
+    Datum values[tupdesc->natts];
+    bool nulls[tupdesc->natts];
+    lower_row(exec_env,
+              plan,
+              tupdesc,
+              obj->body.tuple,
+              tuple_ref,
+              ret,
+              values,
+              nulls);
 
     return 1;
 }
 
+// The first field of the box must be a mutable reference to an array of the
+// row structs of the query, which is what lower_all creates and stores there
+static void
+check_rows_box(Context *ctx, QueryPlan *plan, wasm_struct_type_t box_type) {
+    wasm_module_t module = (wasm_module_t)ctx->module->module;
+    bool mutable = false;
+    if (wasm_struct_type_get_field_count(box_type) < 1)
+        ereport(ERROR, errmsg("box struct has no fields"));
+    wasm_ref_type_t field_type =
+        wasm_struct_type_get_field_type(box_type, 0, &mutable);
+    wasm_array_type_t array_type =
+        wasm_ref_type_get_referred_array(field_type, module, true);
+    if (!array_type)
+        array_type =
+            wasm_ref_type_get_referred_array(field_type, module, false);
+    if (!mutable || !array_type)
+        ereport(ERROR,
+                errmsg("first field of the box must be a mutable array"));
+    wasm_ref_type_t elem_type = wasm_array_type_get_elem_type(array_type, NULL);
+    if ((elem_type.value_type != VALUE_TYPE_HT_NULLABLE_REF
+         && elem_type.value_type != VALUE_TYPE_HT_NON_NULLABLE_REF)
+        || elem_type.heap_type != plan->ret_type.heap_type)
+        ereport(ERROR,
+                errmsg("box must hold an array of the row type of the query"));
+}
+
+// Lowers all rows of the tuple table into a new array of row structs, set
+// as the first field of box, whose type decides the array type. Returns the
+// number of rows.
+static int32_t
+env_tuple_table_lower_all(wasm_exec_env_t exec_env,
+                          wasm_obj_t tuptable_ref,
+                          wasm_obj_t box_ref) {
+    obj_t tuptable_obj =
+        wasm_externref_obj_get_obj(tuptable_ref, OBJ_TUPLE_TABLE);
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    QueryPlan *plan = ctx->module->queries + tuptable_obj->query_idx;
+    if (plan->nattrs == 0)
+        ereport(ERROR, errmsg("no attributes in the tuple"));
+    if (!box_ref || wasm_obj_is_externref_obj(box_ref)
+        || !wasm_obj_is_struct_obj(box_ref))
+        ereport(ERROR, errmsg("expected a box struct"));
+    wasm_struct_obj_t box = (wasm_struct_obj_t)box_ref;
+
+    // Create the array in the box first, so that it stays reachable while
+    // the rows are allocated
+    SPITupleTable *tuptable = tuptable_obj->body.tuptable;
+    uint32 nrows = tuptable ? (uint32)tuptable->numvals : 0;
+    wasm_struct_type_t box_type =
+        (wasm_struct_type_t)wasm_obj_get_defined_type(box_ref);
+    check_rows_box(ctx, plan, box_type);
+    wasm_ref_type_t array_type =
+        wasm_struct_type_get_field_type(box_type, 0, NULL);
+    wasm_array_obj_t rows =
+        wasm_array_obj_new_with_typeidx(exec_env,
+                                        array_type.heap_type,
+                                        nrows,
+                                        NULL);
+    if (!rows)
+        ereport(ERROR, errmsg("failed to allocate %u rows", nrows));
+    wasm_value_t val = { .gc_obj = (wasm_obj_t)rows };
+    wasm_struct_obj_set_field(box, 0, &val);
+    if (nrows == 0)
+        return 0;
+
+    Datum values[tuptable->tupdesc->natts];
+    bool nulls[tuptable->tupdesc->natts];
+    for (uint32 i = 0; i < nrows; i++) {
+        wasm_struct_obj_t ret =
+            wasm_struct_obj_new_with_typeidx(exec_env,
+                                             plan->ret_type.heap_type);
+        val.gc_obj = (wasm_obj_t)ret;
+        wasm_array_obj_set_elem(rows, i, &val);
+        lower_row(exec_env,
+                  plan,
+                  tuptable->tupdesc,
+                  tuptable->vals[i],
+                  tuptable_ref,
+                  ret,
+                  values,
+                  nulls);
+    }
+
+    return (int32_t)nrows;
+}
+
+typedef struct JsonColumn {
+    char *key; // quoted and escaped, followed by a colon
+    Oid typid;
+    FmgrInfo output;
+} JsonColumn;
+
+static void
+write_json_value(StringInfo sb, JsonColumn *col, Datum value) {
+    char buf[MAXDATELEN + 1];
+    char *str;
+    int len;
+
+    switch (col->typid) {
+        case BOOLOID:
+            appendStringInfoString(sb, DatumGetBool(value) ? "true" : "false");
+            return;
+
+        case INT2OID:
+            len = pg_ltoa(DatumGetInt16(value), buf);
+            appendBinaryStringInfo(sb, buf, len);
+            return;
+
+        case INT4OID:
+            len = pg_ltoa(DatumGetInt32(value), buf);
+            appendBinaryStringInfo(sb, buf, len);
+            return;
+
+        case INT8OID:
+            len = pg_lltoa(DatumGetInt64(value), buf);
+            appendBinaryStringInfo(sb, buf, len);
+            return;
+
+        case FLOAT4OID:
+        case FLOAT8OID:
+        case NUMERICOID:
+            // NaN and Infinity are not JSON numbers, quote them
+            str = OutputFunctionCall(&col->output, value);
+            if (IsValidJsonNumber(str, (int)strlen(str)))
+                appendStringInfoString(sb, str);
+            else
+                escape_json(sb, str);
+            pfree(str);
+            return;
+
+        case TEXTOID:
+        case VARCHAROID:
+            str = TextDatumGetCString(value);
+            escape_json(sb, str);
+            pfree(str);
+            return;
+
+        case JSONOID: {
+            text *json = DatumGetTextPP(value);
+            appendBinaryStringInfo(sb,
+                                   VARDATA_ANY(json),
+                                   VARSIZE_ANY_EXHDR(json));
+            RST_FREE_IF_COPY(json, value);
+            return;
+        }
+
+        case JSONBOID: {
+            Jsonb *jb = DatumGetJsonbP(value);
+            JsonbToCString(sb, &jb->root, VARSIZE(jb));
+            RST_FREE_IF_COPY(jb, value);
+            return;
+        }
+
+        case DATEOID:
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+            // Same ISO 8601 format as to_json()
+            JsonEncodeDateTime(buf, value, col->typid, NULL);
+            appendStringInfoChar(sb, '"');
+            appendStringInfoString(sb, buf);
+            appendStringInfoChar(sb, '"');
+            return;
+
+        case UUIDOID:
+            str = OutputFunctionCall(&col->output, value);
+            appendStringInfoChar(sb, '"');
+            appendStringInfoString(sb, str);
+            appendStringInfoChar(sb, '"');
+            pfree(str);
+            return;
+
+        default:
+            str = OutputFunctionCall(&col->output, value);
+            escape_json(sb, str);
+            pfree(str);
+            return;
+    }
+}
+
+// Prepares keys and output functions of all columns once, keys are taken
+// from field_names (an array of texts) or the column names if it's NULL
+static JsonColumn *
+prepare_json_columns(TupleDesc tupdesc, wasm_array_obj_t field_names) {
+    int natts = tupdesc->natts;
+    if (field_names && wasm_array_obj_length(field_names) < (uint32)natts)
+        ereport(ERROR,
+                errmsg("expected %d field names, got %u",
+                       natts,
+                       wasm_array_obj_length(field_names)));
+
+    JsonColumn *cols = palloc(sizeof(JsonColumn) * Max(natts, 1));
+    StringInfoData key;
+    initStringInfo(&key);
+    for (int i = 0; i < natts; i++) {
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+        resetStringInfo(&key);
+        if (i > 0)
+            appendStringInfoChar(&key, ',');
+        if (field_names) {
+            wasm_value_t val;
+            wasm_array_obj_get_elem(field_names, i, false, &val);
+            if (!val.gc_obj)
+                ereport(ERROR, errmsg("null field name at #%d", i));
+            char *name = wasm_text_copy_cstring(val.gc_obj);
+            escape_json(&key, name);
+            pfree(name);
+        }
+        else {
+            escape_json(&key, NameStr(attr->attname));
+        }
+        appendStringInfoChar(&key, ':');
+        cols[i].key = pstrdup(key.data);
+        cols[i].typid = getBaseType(attr->atttypid);
+        Oid output_func;
+        bool is_varlena;
+        getTypeOutputInfo(cols[i].typid, &output_func, &is_varlena);
+        fmgr_info(output_func, &cols[i].output);
+    }
+    pfree(key.data);
+    return cols;
+}
+
+static void
+free_json_columns(JsonColumn *cols, int natts) {
+    for (int i = 0; i < natts; i++)
+        pfree(cols[i].key);
+    pfree(cols);
+}
+
+static void
+write_json_object(StringInfo sb,
+                  JsonColumn *cols,
+                  TupleDesc tupdesc,
+                  HeapTuple tuple,
+                  Datum *values,
+                  bool *nulls) {
+    heap_deform_tuple(tuple, tupdesc, values, nulls);
+    appendStringInfoChar(sb, '{');
+    for (int i = 0; i < tupdesc->natts; i++) {
+        appendStringInfoString(sb, cols[i].key);
+        if (nulls[i])
+            appendStringInfoString(sb, "null");
+        else
+            write_json_value(sb, &cols[i], values[i]);
+    }
+    appendStringInfoChar(sb, '}');
+}
+
+static wasm_array_obj_t
+field_names_array(wasm_obj_t field_names_ref) {
+    if (!field_names_ref)
+        return NULL;
+    if (wasm_obj_is_externref_obj(field_names_ref)
+        || !wasm_obj_is_array_obj(field_names_ref))
+        ereport(ERROR, errmsg("expected an array of field names"));
+
+    // The elements are read as references, an array of numbers won't do
+    wasm_array_type_t array_type =
+        (wasm_array_type_t)wasm_obj_get_defined_type(field_names_ref);
+    wasm_ref_type_t elem_type = wasm_array_type_get_elem_type(array_type, NULL);
+    if (elem_type.value_type != VALUE_TYPE_EXTERNREF
+        && !((elem_type.value_type == VALUE_TYPE_HT_NULLABLE_REF
+              || elem_type.value_type == VALUE_TYPE_HT_NON_NULLABLE_REF)
+             && elem_type.heap_type == HEAP_TYPE_EXTERN))
+        ereport(ERROR, errmsg("expected an array of field names"));
+    return (wasm_array_obj_t)field_names_ref;
+}
+
+// Appends the rows of the tuple table as a JSON array of objects to a
+// string builder, keyed by field_names (an array of texts), or by the column
+// names if it's null. Returns the number of rows.
+static int32_t
+env_tuple_table_write_json(wasm_exec_env_t exec_env,
+                           wasm_obj_t tuptable_ref,
+                           wasm_obj_t sb_ref,
+                           wasm_obj_t field_names_ref) {
+    obj_t tuptable_obj =
+        wasm_externref_obj_get_obj(tuptable_ref, OBJ_TUPLE_TABLE);
+    obj_t sb_obj = wasm_externref_obj_get_obj(sb_ref, OBJ_STRING_INFO);
+    StringInfo sb = sb_obj->body.sb;
+    if (sb->maxlen == 0)
+        ereport(ERROR, errmsg("StringInfo is read-only"));
+    SPITupleTable *tuptable = tuptable_obj->body.tuptable;
+    if (!tuptable) {
+        appendStringInfoString(sb, "[]");
+        return 0;
+    }
+
+    TupleDesc tupdesc = tuptable->tupdesc;
+    int natts = tupdesc->natts;
+    JsonColumn *cols =
+        prepare_json_columns(tupdesc, field_names_array(field_names_ref));
+
+    // Write all rows, deformed once each
+    Datum values[Max(natts, 1)];
+    bool nulls[Max(natts, 1)];
+    appendStringInfoChar(sb, '[');
+    for (uint64 row = 0; row < tuptable->numvals; row++) {
+        if (row > 0)
+            appendStringInfoChar(sb, ',');
+        write_json_object(sb,
+                          cols,
+                          tupdesc,
+                          tuptable->vals[row],
+                          values,
+                          nulls);
+    }
+    appendStringInfoChar(sb, ']');
+
+    free_json_columns(cols, natts);
+    return (int32_t)tuptable->numvals;
+}
+
+#define STREAM_CSV 0
+#define STREAM_NDJSON 1
+#define STREAM_JSON_ARRAY 2
+
+static void
+write_csv_value(StringInfo sb, const char *str) {
+    // Empty strings are quoted as COPY does, telling them apart from NULL
+    if (str[0] != '\0' && strpbrk(str, ",\"\r\n") == NULL) {
+        appendStringInfoString(sb, str);
+        return;
+    }
+    appendStringInfoChar(sb, '"');
+    for (const char *p = str; *p; p++) {
+        if (*p == '"')
+            appendStringInfoChar(sb, '"');
+        appendStringInfoChar(sb, *p);
+    }
+    appendStringInfoChar(sb, '"');
+}
+
+static void
+write_csv_header(StringInfo sb, TupleDesc tupdesc) {
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (i > 0)
+            appendStringInfoChar(sb, ',');
+        write_csv_value(sb, NameStr(TupleDescAttr(tupdesc, i)->attname));
+    }
+    appendStringInfoString(sb, "\r\n");
+}
+
+static void
+write_csv_row(StringInfo sb,
+              JsonColumn *cols,
+              TupleDesc tupdesc,
+              HeapTuple tuple,
+              Datum *values,
+              bool *nulls) {
+    heap_deform_tuple(tuple, tupdesc, values, nulls);
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (i > 0)
+            appendStringInfoChar(sb, ',');
+        if (nulls[i])
+            continue;
+        char *str = OutputFunctionCall(&cols[i].output, values[i]);
+        write_csv_value(sb, str);
+        pfree(str);
+    }
+    appendStringInfoString(sb, "\r\n");
+}
+
+// Sends data as one HTTP/1.1 chunk, or the last chunk if len is 0
+static bool
+send_http_chunk(Context *ctx, StringInfo chunk, const char *data, int len) {
+    resetStringInfo(chunk);
+    appendStringInfo(chunk, "%x\r\n", len);
+    if (len > 0)
+        appendBinaryStringInfo(chunk, data, len);
+    appendStringInfoString(chunk, "\r\n");
+    if (len == 0)
+        appendStringInfoString(chunk, "\r\n");
+    return rst_send_all(ctx, chunk->data, chunk->len);
+}
+
+// Streams the remaining rows of the cursor to the client as the body of a
+// response with "Transfer-Encoding: chunked", whose head the guest has sent
+// already. Rows are fetched chunk_rows at a time and each batch is encoded
+// (CSV, NDJSON or JSON array) and sent as one chunk before the next fetch,
+// so memory is bounded by the batch size and the socket paces the fetches.
+// A chunk_rows of 0 or less sizes the batches adaptively like cursor_fetch.
+// Returns the number of rows sent, or -1 if the client went away.
+static int32_t
+env_cursor_stream(wasm_exec_env_t exec_env,
+                  wasm_obj_t cursor_ref,
+                  int32_t format,
+                  int32_t chunk_rows) {
+    obj_t obj = wasm_externref_obj_get_obj(cursor_ref, OBJ_PORTAL);
+    Portal portal = rst_obj_get_portal(obj);
+    if (!PortalIsValid(portal))
+        ereport(ERROR, errmsg("portal already closed"));
+    if (format < STREAM_CSV || format > STREAM_JSON_ARRAY)
+        ereport(ERROR, errmsg("unknown stream format: %d", format));
+
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    QueryPlan *plan = ctx->module->queries + obj->query_idx;
+    MemoryContext batch_context = AllocSetContextCreate(CurrentMemoryContext,
+                                                        "rustica stream",
+                                                        ALLOCSET_DEFAULT_SIZES);
+    MemoryContext old_context = CurrentMemoryContext;
+    StringInfoData body;
+    StringInfoData chunk;
+    initStringInfo(&body);
+    initStringInfo(&chunk);
+    JsonColumn *cols = NULL;
+    int natts = 0;
+    uint64 total = 0;
+    bool sent = true;
+
+    for (;;) {
+        long rows = chunk_rows;
+        instr_time start;
+        INSTR_TIME_SET_CURRENT(start);
+        if (chunk_rows > 0)
+            SPI_cursor_fetch(portal, true, chunk_rows);
+        else
+            rows = adaptive_fetch(plan, portal);
+        query_stat_add(plan, start, SPI_processed, 0);
+        SPITupleTable *tuptable = SPI_tuptable;
+        uint64 nrows = SPI_processed;
+        TupleDesc tupdesc = tuptable ? tuptable->tupdesc : NULL;
+
+        resetStringInfo(&body);
+        if (!cols && tupdesc) {
+            natts = tupdesc->natts;
+            cols = prepare_json_columns(tupdesc, NULL);
+            if (format == STREAM_CSV)
+                write_csv_header(&body, tupdesc);
+            else if (format == STREAM_JSON_ARRAY)
+                appendStringInfoChar(&body, '[');
+        }
+
+        if (nrows > 0) {
+            Datum values[Max(natts, 1)];
+            bool nulls[Max(natts, 1)];
+            MemoryContextSwitchTo(batch_context);
+            for (uint64 row = 0; row < nrows; row++) {
+                HeapTuple tuple = tuptable->vals[row];
+                switch (format) {
+                    case STREAM_CSV:
+                        write_csv_row(&body,
+                                      cols,
+                                      tupdesc,
+                                      tuple,
+                                      values,
+                                      nulls);
+                        break;
+                    case STREAM_NDJSON:
+                        write_json_object(&body,
+                                          cols,
+                                          tupdesc,
+                                          tuple,
+                                          values,
+                                          nulls);
+                        appendStringInfoChar(&body, '\n');
+                        break;
+                    case STREAM_JSON_ARRAY:
+                        if (total + row > 0)
+                            appendStringInfoChar(&body, ',');
+                        write_json_object(&body,
+                                          cols,
+                                          tupdesc,
+                                          tuple,
+                                          values,
+                                          nulls);
+                        break;
+                }
+            }
+            MemoryContextSwitchTo(old_context);
+            MemoryContextReset(batch_context);
+            total += nrows;
+        }
+        SPI_freetuptable(tuptable);
+
+        bool done = nrows < (uint64)rows;
+        if (done && format == STREAM_JSON_ARRAY)
+            appendStringInfoString(&body, cols ? "]" : "[]");
+        if (body.len > 0 && !send_http_chunk(ctx, &chunk, body.data, body.len))
+        {
+            sent = false;
+            break;
+        }
+        if (done)
+            break;
+        CHECK_FOR_INTERRUPTS();
+    }
+    if (sent)
+        sent = send_http_chunk(ctx, &chunk, NULL, 0);
+
+    if (cols)
+        free_json_columns(cols, natts);
+    pfree(body.data);
+    pfree(chunk.data);
+    MemoryContextDelete(batch_context);
+    if (!sent)
+        return -1;
+    if (total > INT_MAX)
+        ereport(ERROR, errmsg("too many rows"));
+    return (int32_t)total;
+}
+
 static NativeSymbol query_symbols[] = {
     { "execute_statement", env_execute_statement, "(i)i" },
+    { "execute_batch", env_execute_batch, "(ir)i" },
+    { "execute_returning", env_execute_returning, "(i)r" },
     { "cursor_open", env_cursor_open, "(i)r" },
     { "cursor_fetch", env_cursor_fetch, "(ri)r" },
     { "cursor_fetch_all", env_cursor_fetch_all, "(r)r" },
     { "cursor_close", env_cursor_close, "(r)i" },
+    { "cursor_stream", env_cursor_stream, "(rii)i" },
     { "tuple_table_len", env_tuple_table_len, "(r)i" },
     { "tuple_table_get", env_tuple_table_get, "(ri)r" },
     { "tuple_lower", env_tuple_lower, "(r)i" },
+    { "tuple_table_lower_all", env_tuple_table_lower_all, "(rr)i" },
+    { "tuple_table_write_json", env_tuple_table_write_json, "(rrr)i" },
 };
 
 void
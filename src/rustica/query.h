@@ -6,6 +6,7 @@
 
 #include "postgres.h"
 #include "executor/spi.h"
+#include "lib/stringinfo.h"
 #include "storage/latch.h"
 
 #include "llhttp.h"
@@ -29,7 +30,9 @@ typedef struct Context {
     llhttp_t http_parser;
     llhttp_settings_t http_settings;
     wasm_obj_t current_buf;
+    char *current_base;
     int32_t bytes_view;
+    wasm_ref_type_t bytes_view_buf;
     wasm_function_inst_t on_message_begin;
     wasm_function_inst_t on_method;
     wasm_function_inst_t on_method_complete;
@@ -46,6 +49,12 @@ typedef struct Context {
     wasm_function_inst_t on_message_complete;
     wasm_function_inst_t on_error;
 
+    // Host-driven request loop, used when the module exports handle_request
+    bool request_loop;
+    bool message_complete;
+    wasm_local_obj_ref_t recv_buf_ref;
+    StringInfoData send_buf;
+
     PreparedModule *module;
     wasm_struct_obj_t queries;
     WASMRttTypeRef anyref_array;
@@ -63,8 +72,29 @@ typedef struct Context {
 typedef RST_WASM_TO_PG_RET (*WASM2PGFunc)(RST_WASM_TO_PG_ARGS);
 typedef RST_PG_TO_WASM_RET (*PG2WASMFunc)(RST_PG_TO_WASM_ARGS);
 
+// Fields of these kinds are converted in place without calling converters
+typedef enum ScalarKind {
+    SCALAR_NONE = 0,
+    SCALAR_BOOL,   // i32
+    SCALAR_INT4,   // i32
+    SCALAR_INT8,   // i64
+    SCALAR_FLOAT4, // f32
+    SCALAR_FLOAT8, // f64
+} ScalarKind;
+
+// What the statement of a query does, as far as result caching goes
+typedef enum QueryClass {
+    QUERY_UNCLASSIFIED = 0,
+    QUERY_CACHEABLE, // a plain SELECT
+    QUERY_READ_ONLY, // SELECT with row locks or volatile functions
+    QUERY_WRITES,
+} QueryClass;
+
 typedef struct QueryPlan {
-    SPIPlanPtr plan;
+    char *sql;
+    bool hot;
+    uint64 calls;
+    SPIPlanPtr plan; // prepared on first use, see rst_query_plan_prepare()
     uint32 nargs;
     uint32 nattrs;
     Oid *argtypes;
@@ -73,14 +103,56 @@ typedef struct QueryPlan {
     wasm_ref_type_t *ret_field_types;
     WASM2PGFunc *wasm_to_pg_funcs;
     PG2WASMFunc *pg_to_wasm_funcs;
+
+    // Fast paths when all arguments or all result fields are scalars, with
+    // struct field offsets resolved from the first struct seen
+    bool scalar_args;
+    bool scalar_rets;
+    uint8 *arg_kinds;
+    uint8 *ret_kinds;
+    uint32 *arg_offsets;
+    uint32 *ret_offsets;
+    bool arg_offsets_ready;
+    bool ret_offsets_ready;
+
+    // Adaptive cursor fetches: moving averages of the bytes and microseconds
+    // per row seen so far, and the batch size they suggest
+    double fetch_row_bytes;
+    double fetch_row_usecs;
+    long fetch_rows;
+
+    // Execution statistics not yet flushed to shared memory, times in ms,
+    // see rst_stats_flush_queries()
+    uint64 stat_calls;
+    uint64 stat_rows;
+    double stat_total_time;
+    double stat_max_time;
+    double stat_conv_time;
+    int64 stat_generic_plans; // plan cache counters already flushed
+    int64 stat_custom_plans;
+    uint64 stat_cache_hits;
+
+    // Results of executions are cached for cache_ttl seconds if it's set and
+    // the statement is cacheable, see result_cache.c
+    int32 cache_ttl;
+    QueryClass cache_class;
+    bool cache_unknown_writes; // may write relations the plan doesn't name
+    int16 *arg_typlens;
+    bool *arg_typbyvals;
 } QueryPlan;
 
 void
-rst_init_query_plan(QueryPlan *plan, HeapTuple query_tup, TupleDesc tupdesc);
+rst_init_query_plan(QueryPlan *plan,
+                    HeapTuple query_tup,
+                    TupleDesc tupdesc,
+                    MemoryContext mcxt);
 
 void
 rst_free_query_plan(QueryPlan *plan);
 
+SPIPlanPtr
+rst_query_plan_prepare(QueryPlan *plan);
+
 void
 rst_init_instance_context(wasm_exec_env_t exec_env);
 
@@ -90,4 +162,7 @@ rst_free_instance_context(wasm_exec_env_t exec_env);
 void
 rst_register_natives_query();
 
+bool
+rst_send_all(Context *ctx, const char *data, int32_t len);
+
 #endif /* RUSTICA_QUERY_H */
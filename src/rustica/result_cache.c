@@ -0,0 +1,512 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#include "postgres.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/xact.h"
+#include "commands/trigger.h"
+#include "common/hashfn.h"
+#include "optimizer/optimizer.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/plancache.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+
+#include "rustica/gucs.h"
+#include "rustica/module.h"
+#include "rustica/result_cache.h"
+
+// A cached result may depend on this many relations at most
+#define RESULT_CACHE_MAX_RELS 8
+
+// The generation keeps results of a query index from outliving a hot-swap
+// that changes its SQL
+typedef struct ResultCacheKey {
+    char module[RST_MODULE_NAME_MAXLEN + 1];
+    int64 generation;
+    int32 query_idx;
+    uint64 args_hash;
+} ResultCacheKey;
+
+typedef struct ResultCacheEntry {
+    ResultCacheKey key;
+    int slot;
+} ResultCacheEntry;
+
+// Fixed-size slot holding the serialized arguments, then each tuple as its
+// length and its HeapTupleHeader
+typedef struct ResultCacheSlot {
+    ResultCacheKey key;
+    bool used;
+    pg_atomic_uint32 referenced; // set by readers, cleared by the clock
+    TimestampTz expires;
+    int nrels;
+    Oid rels[RESULT_CACHE_MAX_RELS];
+    uint32 args_len;
+    uint32 data_len;
+    uint32 ntuples;
+    char data[FLEXIBLE_ARRAY_MEMBER];
+} ResultCacheSlot;
+
+typedef struct ResultCacheShared {
+    LWLock *lock;
+    pg_atomic_uint64 generation; // bumped by every invalidation
+    int nslots;
+    int clock_hand;
+    Size slot_size;
+    char slots[FLEXIBLE_ARRAY_MEMBER];
+} ResultCacheShared;
+
+static ResultCacheShared *result_cache = NULL;
+static HTAB *result_cache_index = NULL;
+
+// Relations written by the current transaction, invalidated at commit, and
+// whether it may have written others as well, invalidating everything
+static List *written_rels = NIL;
+static bool written_unknown = false;
+
+static Size
+slot_size() {
+    return MAXALIGN((Size)rst_result_cache_entry_size * 1024);
+}
+
+static int
+nslots() {
+    return (int)((Size)rst_result_cache_size * 1024 / slot_size());
+}
+
+static inline ResultCacheSlot *
+get_slot(int i) {
+    return (ResultCacheSlot *)(result_cache->slots
+                               + (Size)i * result_cache->slot_size);
+}
+
+Size
+rst_result_cache_shmem_size() {
+    if (nslots() == 0)
+        return 0;
+    return add_size(MAXALIGN(add_size(offsetof(ResultCacheShared, slots),
+                                      mul_size(nslots(), slot_size()))),
+                    hash_estimate_size(nslots(), sizeof(ResultCacheEntry)));
+}
+
+void
+rst_result_cache_shmem_request() {
+    if (nslots() == 0)
+        return;
+    RequestAddinShmemSpace(rst_result_cache_shmem_size());
+    RequestNamedLWLockTranche("rustica_result_cache", 1);
+}
+
+void
+rst_result_cache_shmem_startup() {
+    if (nslots() == 0)
+        return;
+
+    bool found;
+    Size size = offsetof(ResultCacheShared, slots)
+                + (Size)nslots() * slot_size();
+    result_cache = ShmemInitStruct("rustica_result_cache", size, &found);
+    if (!found) {
+        result_cache->lock =
+            &(GetNamedLWLockTranche("rustica_result_cache"))->lock;
+        pg_atomic_init_u64(&result_cache->generation, 0);
+        result_cache->nslots = nslots();
+        result_cache->clock_hand = 0;
+        result_cache->slot_size = slot_size();
+        for (int i = 0; i < result_cache->nslots; i++) {
+            ResultCacheSlot *slot = get_slot(i);
+            slot->used = false;
+            pg_atomic_init_u32(&slot->referenced, 0);
+        }
+    }
+
+    HASHCTL info = { .keysize = sizeof(ResultCacheKey),
+                     .entrysize = sizeof(ResultCacheEntry) };
+    result_cache_index = ShmemInitHash("rustica_result_cache_index",
+                                       nslots(),
+                                       nslots(),
+                                       &info,
+                                       HASH_ELEM | HASH_BLOBS);
+}
+
+// Drops the results depending on the relation, or all if it's InvalidOid.
+// Bumping the generation also keeps results computed before from being
+// stored afterwards.
+static void
+invalidate(Oid relid) {
+    LWLockAcquire(result_cache->lock, LW_EXCLUSIVE);
+    pg_atomic_fetch_add_u64(&result_cache->generation, 1);
+    for (int i = 0; i < result_cache->nslots; i++) {
+        ResultCacheSlot *slot = get_slot(i);
+        if (!slot->used)
+            continue;
+        bool depends = !OidIsValid(relid);
+        for (int j = 0; j < slot->nrels && !depends; j++)
+            depends = slot->rels[j] == relid;
+        if (depends) {
+            hash_search(result_cache_index, &slot->key, HASH_REMOVE, NULL);
+            slot->used = false;
+        }
+    }
+    LWLockRelease(result_cache->lock);
+}
+
+static void
+relcache_callback(Datum arg, Oid relid) {
+    invalidate(relid);
+}
+
+static void
+xact_callback(XactEvent event, void *arg) {
+    switch (event) {
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PARALLEL_COMMIT: {
+            ListCell *lc;
+            if (written_unknown)
+                invalidate(InvalidOid);
+            else
+                foreach (lc, written_rels)
+                    invalidate(lfirst_oid(lc));
+        }
+            /* FALLTHROUGH */
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+            list_free(written_rels);
+            written_rels = NIL;
+            written_unknown = false;
+            break;
+
+        default:
+            break;
+    }
+}
+
+void
+rst_result_cache_worker_init() {
+    if (!result_cache)
+        return;
+    CacheRegisterRelcacheCallback(relcache_callback, (Datum)0);
+    RegisterXactCallback(xact_callback, NULL);
+}
+
+// Whether writing to the relation may fire triggers that write elsewhere.
+// The referencing side of foreign keys only checks, everything else counts.
+static bool
+has_writing_triggers(Oid relid) {
+    Relation rel = try_relation_open(relid, AccessShareLock);
+    if (!rel)
+        return false;
+    bool rv = false;
+    TriggerDesc *trigdesc = rel->trigdesc;
+    for (int i = 0; trigdesc && i < trigdesc->numtriggers && !rv; i++)
+        rv = RI_FKey_trigger_type(trigdesc->triggers[i].tgfoid)
+             != RI_TRIGGER_FK;
+    relation_close(rel, AccessShareLock);
+    return rv;
+}
+
+// Tells whether the statement only reads, and whether its results can be
+// cached, once for the lifetime of the plan. Volatile functions and the
+// triggers of written relations may write anything, so statements with
+// either are taken to write relations they don't name.
+static void
+classify(QueryPlan *plan, SPIPlanPtr spi_plan) {
+    if (plan->cache_class != QUERY_UNCLASSIFIED)
+        return;
+
+    QueryClass cls = QUERY_CACHEABLE;
+    bool unknown_writes = false;
+    ListCell *lc;
+    foreach (lc, SPI_plan_get_plan_sources(spi_plan)) {
+        CachedPlanSource *source = (CachedPlanSource *)lfirst(lc);
+        bool writes = source->commandTag != CMDTAG_SELECT;
+        ListCell *qlc;
+        foreach (qlc, source->query_list) {
+            Query *query = lfirst_node(Query, qlc);
+            bool is_volatile = contain_volatile_functions((Node *)query);
+            if (query->commandType != CMD_SELECT || query->hasModifyingCTE)
+                writes = true;
+            else if (query->rowMarks != NIL || is_volatile)
+                cls = Max(cls, QUERY_READ_ONLY);
+            unknown_writes |= is_volatile;
+        }
+        if (writes) {
+            cls = QUERY_WRITES;
+            ListCell *rlc;
+            foreach (rlc, source->relationOids)
+                unknown_writes |= has_writing_triggers(lfirst_oid(rlc));
+        }
+    }
+
+    // Argument types are needed to serialize the arguments as a cache key
+    if (cls == QUERY_CACHEABLE && plan->nargs > 0) {
+        MemoryContext mcxt = GetMemoryChunkContext(plan->sql);
+        plan->arg_typlens =
+            MemoryContextAlloc(mcxt, sizeof(int16) * plan->nargs);
+        plan->arg_typbyvals =
+            MemoryContextAlloc(mcxt, sizeof(bool) * plan->nargs);
+        for (uint32 i = 0; i < plan->nargs; i++)
+            get_typlenbyval(plan->argtypes[i],
+                            &plan->arg_typlens[i],
+                            &plan->arg_typbyvals[i]);
+    }
+    plan->cache_unknown_writes = unknown_writes;
+    plan->cache_class = cls;
+}
+
+static void
+serialize_args(ResultCacheProbe *probe, Datum *values) {
+    QueryPlan *plan = probe->plan;
+    StringInfo args = &probe->args;
+    for (uint32 i = 0; i < plan->nargs; i++) {
+        int16 typlen = plan->arg_typlens[i];
+        if (plan->arg_typbyvals[i]) {
+            appendBinaryStringInfo(args, (char *)&values[i], sizeof(Datum));
+        }
+        else if (typlen > 0) {
+            appendBinaryStringInfo(args, DatumGetPointer(values[i]), typlen);
+        }
+        else {
+            char *data;
+            uint32 len;
+            if (typlen == -1) {
+                struct varlena *v = pg_detoast_datum_packed(
+                    (struct varlena *)DatumGetPointer(values[i]));
+                data = VARDATA_ANY(v);
+                len = VARSIZE_ANY_EXHDR(v);
+            }
+            else {
+                data = DatumGetCString(values[i]);
+                len = strlen(data);
+            }
+            appendBinaryStringInfo(args, (char *)&len, sizeof(len));
+            appendBinaryStringInfo(args, data, len);
+        }
+    }
+}
+
+// Prepares a cache lookup of the query with the given arguments. Returns
+// false if the result can't come from or go to the cache: caching is off
+// for the query or it's not a stable read, or the current transaction has
+// written something the cache wouldn't reflect.
+bool
+rst_result_cache_probe(ResultCacheProbe *probe,
+                       PreparedModule *module,
+                       int32 query_idx,
+                       QueryPlan *plan,
+                       SPIPlanPtr spi_plan,
+                       Datum *values) {
+    if (!result_cache || plan->cache_ttl <= 0 || written_rels != NIL
+        || written_unknown)
+        return false;
+    classify(plan, spi_plan);
+    if (plan->cache_class != QUERY_CACHEABLE)
+        return false;
+
+    probe->module = module;
+    probe->query_idx = query_idx;
+    probe->plan = plan;
+    probe->spi_plan = spi_plan;
+    probe->generation = pg_atomic_read_u64(&result_cache->generation);
+    initStringInfo(&probe->args);
+    serialize_args(probe, values);
+    probe->args_hash = hash_bytes_extended((unsigned char *)probe->args.data,
+                                           probe->args.len,
+                                           0);
+    return true;
+}
+
+static void
+make_key(ResultCacheProbe *probe, ResultCacheKey *key) {
+    memset(key, 0, sizeof(ResultCacheKey));
+    strlcpy(key->module, probe->module->name, sizeof(key->module));
+    key->generation = probe->module->generation;
+    key->query_idx = probe->query_idx;
+    key->args_hash = probe->args_hash;
+}
+
+static TupleDesc
+result_desc(SPIPlanPtr spi_plan) {
+    List *sources = SPI_plan_get_plan_sources(spi_plan);
+    return ((CachedPlanSource *)linitial(sources))->resultDesc;
+}
+
+// Returns the cached rows as a tuple table in its own memory context, to be
+// released with MemoryContextDelete() instead of SPI_freetuptable(), or NULL
+// if there is no fresh result for the arguments.
+SPITupleTable *
+rst_result_cache_get(ResultCacheProbe *probe) {
+    ResultCacheKey key;
+    make_key(probe, &key);
+    TimestampTz now = GetCurrentTimestamp();
+
+    // The tuple table is only created on a hit, copying the rows out of the
+    // slot while the lock is held
+    SPITupleTable *tuptable = NULL;
+    LWLockAcquire(result_cache->lock, LW_SHARED);
+    ResultCacheEntry *entry =
+        hash_search(result_cache_index, &key, HASH_FIND, NULL);
+    ResultCacheSlot *slot = entry ? get_slot(entry->slot) : NULL;
+    if (slot && slot->expires > now && slot->args_len == probe->args.len
+        && memcmp(slot->data, probe->args.data, slot->args_len) == 0) {
+        pg_atomic_write_u32(&slot->referenced, 1);
+        MemoryContext tuptabcxt =
+            AllocSetContextCreate(CurrentMemoryContext,
+                                  "rustica cached result",
+                                  ALLOCSET_SMALL_SIZES);
+        MemoryContext old_context = MemoryContextSwitchTo(tuptabcxt);
+        tuptable = palloc0(sizeof(SPITupleTable));
+        tuptable->tuptabcxt = tuptabcxt;
+        tuptable->vals = palloc(sizeof(HeapTuple) * Max(slot->ntuples, 1));
+        tuptable->alloced = tuptable->numvals = slot->ntuples;
+        char *ptr = slot->data + slot->args_len;
+        for (uint32 i = 0; i < slot->ntuples; i++) {
+            uint32 len;
+            memcpy(&len, ptr, sizeof(len));
+            ptr += sizeof(len);
+            HeapTuple tuple = palloc(HEAPTUPLESIZE + len);
+            tuple->t_len = len;
+            ItemPointerSetInvalid(&tuple->t_self);
+            tuple->t_tableOid = InvalidOid;
+            tuple->t_data = (HeapTupleHeader)((char *)tuple + HEAPTUPLESIZE);
+            memcpy(tuple->t_data, ptr, len);
+            ptr += len;
+            tuptable->vals[i] = tuple;
+        }
+        MemoryContextSwitchTo(old_context);
+    }
+    LWLockRelease(result_cache->lock);
+
+    if (tuptable) {
+        MemoryContext old_context =
+            MemoryContextSwitchTo(tuptable->tuptabcxt);
+        tuptable->tupdesc = CreateTupleDescCopy(result_desc(probe->spi_plan));
+        MemoryContextSwitchTo(old_context);
+    }
+    return tuptable;
+}
+
+// Picks a slot for a new result with the clock algorithm, evicting the
+// first one not referenced since the hand last passed. Needs the lock in
+// exclusive mode.
+static int
+clock_sweep() {
+    for (;;) {
+        int i = result_cache->clock_hand;
+        result_cache->clock_hand = (i + 1) % result_cache->nslots;
+        ResultCacheSlot *slot = get_slot(i);
+        if (!slot->used)
+            return i;
+        if (pg_atomic_exchange_u32(&slot->referenced, 0) == 0) {
+            hash_search(result_cache_index, &slot->key, HASH_REMOVE, NULL);
+            slot->used = false;
+            return i;
+        }
+    }
+}
+
+// Stores the rows of an execution prepared by rst_result_cache_probe(),
+// unless they don't fit in a slot or something was invalidated meanwhile.
+void
+rst_result_cache_put(ResultCacheProbe *probe,
+                     SPITupleTable *tuptable,
+                     uint64 nrows) {
+    Size capacity = result_cache->slot_size - offsetof(ResultCacheSlot, data);
+    Size size = probe->args.len;
+    for (uint64 i = 0; i < nrows; i++)
+        size += sizeof(uint32) + tuptable->vals[i]->t_len;
+    if (size > capacity)
+        return;
+    List *sources = SPI_plan_get_plan_sources(probe->spi_plan);
+    List *rels = ((CachedPlanSource *)linitial(sources))->relationOids;
+    if (list_length(rels) > RESULT_CACHE_MAX_RELS)
+        return;
+    ResultCacheKey key;
+    make_key(probe, &key);
+    TimestampTz expires = TimestampTzPlusMilliseconds(
+        GetCurrentTimestamp(),
+        (int64)probe->plan->cache_ttl * 1000);
+
+    LWLockAcquire(result_cache->lock, LW_EXCLUSIVE);
+    if (pg_atomic_read_u64(&result_cache->generation) != probe->generation) {
+        LWLockRelease(result_cache->lock);
+        return;
+    }
+    ResultCacheEntry *entry =
+        hash_search(result_cache_index, &key, HASH_FIND, NULL);
+    int slot_idx;
+    if (entry) {
+        slot_idx = entry->slot;
+    }
+    else {
+        slot_idx = clock_sweep();
+        entry = hash_search(result_cache_index, &key, HASH_ENTER_NULL, NULL);
+        if (!entry) {
+            LWLockRelease(result_cache->lock);
+            return;
+        }
+        entry->slot = slot_idx;
+    }
+
+    ResultCacheSlot *slot = get_slot(slot_idx);
+    slot->key = key;
+    slot->used = true;
+    pg_atomic_write_u32(&slot->referenced, 1);
+    slot->expires = expires;
+    slot->nrels = 0;
+    ListCell *lc;
+    foreach (lc, rels)
+        slot->rels[slot->nrels++] = lfirst_oid(lc);
+    slot->args_len = probe->args.len;
+    slot->ntuples = (uint32)nrows;
+    memcpy(slot->data, probe->args.data, probe->args.len);
+    char *ptr = slot->data + probe->args.len;
+    for (uint64 i = 0; i < nrows; i++) {
+        HeapTuple tuple = tuptable->vals[i];
+        memcpy(ptr, &tuple->t_len, sizeof(uint32));
+        ptr += sizeof(uint32);
+        memcpy(ptr, tuple->t_data, tuple->t_len);
+        ptr += tuple->t_len;
+    }
+    slot->data_len = (uint32)(ptr - slot->data);
+    LWLockRelease(result_cache->lock);
+}
+
+// Remembers the relations a writing statement may have changed, so that
+// results depending on them are dropped when the transaction commits, or
+// all results if it may have written relations it doesn't name
+void
+rst_result_cache_note_writes(QueryPlan *plan, SPIPlanPtr spi_plan) {
+    if (!result_cache)
+        return;
+    classify(plan, spi_plan);
+    if (plan->cache_unknown_writes)
+        written_unknown = true;
+    if (plan->cache_class != QUERY_WRITES)
+        return;
+    ListCell *lc;
+    foreach (lc, SPI_plan_get_plan_sources(spi_plan)) {
+        CachedPlanSource *source = (CachedPlanSource *)lfirst(lc);
+        ListCell *rlc;
+        foreach (rlc, source->relationOids)
+            rst_result_cache_note_write_rel(lfirst_oid(rlc));
+    }
+}
+
+void
+rst_result_cache_note_write_rel(Oid relid) {
+    if (!result_cache)
+        return;
+    MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
+    written_rels = list_append_unique_oid(written_rels, relid);
+    MemoryContextSwitchTo(old_context);
+}
@@ -0,0 +1,58 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#ifndef RUSTICA_RESULT_CACHE_H
+#define RUSTICA_RESULT_CACHE_H
+
+#include "postgres.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+
+#include "rustica/query.h"
+
+// A lookup of one execution of a cached query, see rst_result_cache_probe()
+typedef struct ResultCacheProbe {
+    PreparedModule *module;
+    int32 query_idx;
+    QueryPlan *plan;
+    SPIPlanPtr spi_plan;
+    StringInfoData args; // serialized argument values
+    uint64 args_hash;
+    uint64 generation; // invalidations seen before executing
+} ResultCacheProbe;
+
+Size
+rst_result_cache_shmem_size();
+
+void
+rst_result_cache_shmem_request();
+
+void
+rst_result_cache_shmem_startup();
+
+void
+rst_result_cache_worker_init();
+
+bool
+rst_result_cache_probe(ResultCacheProbe *probe,
+                       PreparedModule *module,
+                       int32 query_idx,
+                       QueryPlan *plan,
+                       SPIPlanPtr spi_plan,
+                       Datum *values);
+
+SPITupleTable *
+rst_result_cache_get(ResultCacheProbe *probe);
+
+void
+rst_result_cache_put(ResultCacheProbe *probe,
+                     SPITupleTable *tuptable,
+                     uint64 nrows);
+
+void
+rst_result_cache_note_writes(QueryPlan *plan, SPIPlanPtr spi_plan);
+
+void
+rst_result_cache_note_write_rel(Oid relid);
+
+#endif /* RUSTICA_RESULT_CACHE_H */
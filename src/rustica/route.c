@@ -0,0 +1,280 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "postgres.h"
+#include "catalog/namespace.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/wait_event.h"
+
+#include "rustica/route.h"
+
+// The head of the first request is peeked without consuming it, so that
+// the module sees the connection as is. Later requests on the connection
+// are routed by the request loop from its buffered input.
+#define ROUTE_PEEK_SIZE 8192
+#define ROUTE_PEEK_TIMEOUT 5000
+#define ROUTE_PEEK_INTERVAL 10
+
+// The route table is cached by each worker, and reloaded after a relcache
+// invalidation of rustica.routes: changes to it send one from the trigger,
+// and the next transaction of the worker picks it up. Routes are kept in the
+// order in which they are tried, the first match wins.
+typedef struct Route {
+    char *host; // NULL matches any
+    int port;   // -1 matches any
+    char *path_prefix;
+    int prefix_len;
+    char *module;
+} Route;
+
+static const char *route_sql =
+    "SELECT host, port, path_prefix, module FROM rustica.routes "
+    "ORDER BY priority DESC, length(path_prefix) DESC, host IS NULL, "
+    "port IS NULL";
+
+static MemoryContext route_context = NULL;
+static Route *routes = NULL;
+static int nroutes = 0;
+static bool routes_valid = false;
+static Oid routes_relid = InvalidOid;
+static uint64 route_invalidations = 0;
+
+static void
+relcache_callback(Datum arg, Oid relid) {
+    if (relid == InvalidOid || relid == routes_relid) {
+        routes_valid = false;
+        route_invalidations++;
+    }
+}
+
+// Must be called in a transaction with SPI connected
+static void
+load_routes() {
+    uint64 invalidations = route_invalidations;
+
+    MemoryContextReset(route_context);
+    routes = NULL;
+    nroutes = 0;
+    routes_relid =
+        get_relname_relid("routes", get_namespace_oid("rustica", false));
+
+    debug_query_string = route_sql;
+    int ret = SPI_execute(route_sql, true, 0);
+    if (ret != SPI_OK_SELECT)
+        ereport(ERROR,
+                errmsg("failed to load routes: %s",
+                       SPI_result_code_string(ret)));
+    debug_query_string = NULL;
+
+    MemoryContext old_context = MemoryContextSwitchTo(route_context);
+    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    Route *rv = palloc0(sizeof(Route) * Max(SPI_processed, 1));
+    for (uint64 i = 0; i < SPI_processed; i++) {
+        HeapTuple tuple = SPI_tuptable->vals[i];
+        Route *route = &rv[i];
+        bool isnull;
+        route->host = SPI_getvalue(tuple, tupdesc, 1);
+        Datum port = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+        route->port = isnull ? -1 : DatumGetInt32(port);
+        route->path_prefix = SPI_getvalue(tuple, tupdesc, 3);
+        route->prefix_len = (int)strlen(route->path_prefix);
+        route->module = SPI_getvalue(tuple, tupdesc, 4);
+    }
+    MemoryContextSwitchTo(old_context);
+    routes = rv;
+    nroutes = (int)SPI_processed;
+    SPI_freetuptable(SPI_tuptable);
+
+    // Loaded from a stale snapshot if invalidated meanwhile, try next time
+    routes_valid = invalidations == route_invalidations;
+}
+
+void
+rst_route_worker_startup() {
+    route_context = AllocSetContextCreate(TopMemoryContext,
+                                          "rustica routes",
+                                          ALLOCSET_SMALL_SIZES);
+    CacheRegisterRelcacheCallback(relcache_callback, (Datum)0);
+}
+
+void
+rst_route_worker_teardown() {
+    MemoryContextDelete(route_context);
+    route_context = NULL;
+    routes = NULL;
+    nroutes = 0;
+    routes_valid = false;
+}
+
+// Sends a relcache invalidation of rustica.routes to all workers, from a
+// statement trigger on the table
+Datum
+rst_route_invalidate_trigger(PG_FUNCTION_ARGS) {
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        ereport(ERROR, errmsg("must be called as trigger"));
+    TriggerData *trigdata = (TriggerData *)fcinfo->context;
+    CacheInvalidateRelcache(trigdata->tg_relation);
+    return PointerGetDatum(NULL);
+}
+
+// Returns the head of the first request on the connection as peeked, which
+// is NUL-terminated and complete unless it's too large or timed out. Called
+// outside of transactions as it may wait for a slow client; latch wakeups
+// meanwhile are handed back to the main loop by setting the latch again.
+char *
+rst_route_peek_head(pgsocket fd) {
+    char *buf = palloc(ROUTE_PEEK_SIZE);
+    TimestampTz deadline =
+        TimestampTzPlusMilliseconds(GetCurrentTimestamp(), ROUTE_PEEK_TIMEOUT);
+    ssize_t n = 0;
+    bool latch_set = false;
+
+    for (;;) {
+        CHECK_FOR_INTERRUPTS();
+        ssize_t got =
+            recv(fd, buf, ROUTE_PEEK_SIZE - 1, MSG_PEEK | MSG_DONTWAIT);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            n = 0;
+            break;
+        }
+        n = Max(got, 0);
+        buf[n] = '\0';
+        long remaining =
+            TimestampDifferenceMilliseconds(GetCurrentTimestamp(), deadline);
+        if (strstr(buf, "\r\n\r\n") || n == ROUTE_PEEK_SIZE - 1
+            || remaining <= 0)
+            break;
+
+        // Nothing is consumed, so the socket stays readable with a partial
+        // head: sleep a bit in that case instead of spinning.
+        int events = WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH;
+        long timeout = Min(ROUTE_PEEK_INTERVAL, remaining);
+        if (n == 0) {
+            events |= WL_SOCKET_READABLE;
+            timeout = remaining;
+        }
+        int rc = WaitLatchOrSocket(MyLatch,
+                                   events,
+                                   fd,
+                                   timeout,
+                                   PG_WAIT_EXTENSION);
+        if (rc & WL_LATCH_SET) {
+            ResetLatch(MyLatch);
+            latch_set = true;
+        }
+    }
+    if (latch_set)
+        SetLatch(MyLatch);
+    buf[n] = '\0';
+    return buf;
+}
+
+static char *
+parse_path(char *head) {
+    char *path = strchr(head, ' ');
+    if (!path)
+        return NULL;
+    path++;
+    size_t len = strcspn(path, " ?#\r\n");
+    return pnstrdup(path, len);
+}
+
+static char *
+parse_host(char *head) {
+    char *line = head;
+    while ((line = strstr(line, "\r\n")) != NULL) {
+        line += 2;
+        if (line[0] == '\r' && line[1] == '\n')
+            break; // end of the head
+        if (pg_strncasecmp(line, "host:", 5) != 0)
+            continue;
+        char *host = line + 5;
+        while (*host == ' ' || *host == '\t')
+            host++;
+        size_t len;
+        if (*host == '[')
+            len = strcspn(host, "]\r\n") + (strchr(host, ']') ? 1 : 0);
+        else
+            len = strcspn(host, ": \t\r\n");
+        if (len == 0)
+            return NULL;
+        char *rv = pnstrdup(host, len);
+        for (char *p = rv; *p; p++)
+            *p = pg_ascii_tolower((unsigned char)*p);
+        return rv;
+    }
+    return NULL;
+}
+
+static int
+local_port(pgsocket fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0)
+        return 0;
+    if (addr.ss_family == AF_INET)
+        return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+    if (addr.ss_family == AF_INET6)
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    return 0;
+}
+
+// Returns the name of the module serving the request with the given head,
+// which doesn't have to be NUL-terminated or complete.
+char *
+rst_route_request(pgsocket fd, const char *data, int len) {
+    char *head = pnstrdup(data, Min(len, ROUTE_PEEK_SIZE - 1));
+    char *host = NULL;
+    char *path = NULL;
+    char *rv = NULL;
+
+    if (head[0] != '\0') {
+        host = parse_host(head);
+        path = parse_path(head);
+    }
+
+    if (!routes_valid)
+        load_routes();
+    if (!path)
+        path = pstrdup("/");
+    int path_len = (int)strlen(path);
+    int port = local_port(fd);
+    for (int i = 0; i < nroutes; i++) {
+        Route *route = &routes[i];
+        if (route->host && (!host || strcmp(route->host, host) != 0))
+            continue;
+        if (route->port >= 0 && route->port != port)
+            continue;
+        // The prefix must match whole path segments
+        if (strncmp(path, route->path_prefix, route->prefix_len) != 0)
+            continue;
+        if (route->prefix_len > 0
+            && route->path_prefix[route->prefix_len - 1] != '/'
+            && path_len != route->prefix_len
+            && path[route->prefix_len] != '/')
+            continue;
+        rv = pstrdup(route->module);
+        break;
+    }
+
+    ereport(DEBUG1,
+            errmsg("route host=%s path=%s to module \"%s\"",
+                   host ? host : "(none)",
+                   path,
+                   rv ? rv : RST_DEFAULT_MODULE));
+    return rv ? rv : pstrdup(RST_DEFAULT_MODULE);
+}
@@ -0,0 +1,27 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#ifndef RUSTICA_ROUTE_H
+#define RUSTICA_ROUTE_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#define RST_DEFAULT_MODULE "main"
+
+void
+rst_route_worker_startup();
+
+void
+rst_route_worker_teardown();
+
+char *
+rst_route_peek_head(pgsocket fd);
+
+char *
+rst_route_request(pgsocket fd, const char *data, int len);
+
+Datum
+rst_route_invalidate_trigger(PG_FUNCTION_ARGS);
+
+#endif /* RUSTICA_ROUTE_H */
@@ -0,0 +1,42 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+
+#include "rustica/aot_cache.h"
+#include "rustica/result_cache.h"
+#include "rustica/shmem.h"
+#include "rustica/stats.h"
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void
+rst_shmem_request() {
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+    rst_aot_cache_shmem_request();
+    rst_stats_shmem_request();
+    rst_result_cache_shmem_request();
+}
+
+static void
+rst_shmem_startup() {
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    rst_aot_cache_shmem_startup();
+    rst_stats_shmem_startup();
+    rst_result_cache_shmem_startup();
+    LWLockRelease(AddinShmemInitLock);
+}
+
+void
+rst_init_shmem() {
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = rst_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = rst_shmem_startup;
+}
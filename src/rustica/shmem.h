@@ -0,0 +1,10 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#ifndef RUSTICA_SHMEM_H
+#define RUSTICA_SHMEM_H
+
+void
+rst_init_shmem();
+
+#endif /* RUSTICA_SHMEM_H */
@@ -0,0 +1,417 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#include "postgres.h"
+#include "funcapi.h"
+#include "port/atomics.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/plancache.h"
+
+#include "rustica/gucs.h"
+#include "rustica/stats.h"
+
+typedef struct StatsShared {
+    LWLock *lock;
+    int nslots;
+    WorkerStats slots[FLEXIBLE_ARRAY_MEMBER];
+} StatsShared;
+
+static StatsShared *stats = NULL;
+
+// Execution statistics of one query of a module, merged from all workers.
+// The entry only covers one version of the module: it starts over when a
+// newer generation is flushed, see rst_stats_flush_queries().
+typedef struct QueryStatsKey {
+    char module[RST_MODULE_NAME_MAXLEN + 1];
+    int32 query_idx;
+} QueryStatsKey;
+
+typedef struct QueryStatsEntry {
+    QueryStatsKey key;
+    slock_t mutex; // protects the counters below
+    int64 generation;
+    int64 calls;
+    int64 rows;
+    double total_time;
+    double max_time;
+    double conv_time;
+    int64 generic_plans;
+    int64 custom_plans;
+    int64 cache_hits;
+} QueryStatsEntry;
+
+static LWLock *query_stats_lock = NULL; // protects the hash table itself
+static HTAB *query_stats = NULL;
+
+// Counters of a worker without a slot go nowhere
+static WorkerStats local_stats;
+WorkerStats *rst_worker_stats = &local_stats;
+
+Size
+rst_stats_shmem_size() {
+    return MAXALIGN(
+        add_size(offsetof(StatsShared, slots),
+                 mul_size(max_worker_processes, sizeof(WorkerStats))));
+}
+
+static Size
+query_stats_shmem_size() {
+    return hash_estimate_size(rst_query_stats_max, sizeof(QueryStatsEntry));
+}
+
+void
+rst_stats_shmem_request() {
+    RequestAddinShmemSpace(
+        add_size(rst_stats_shmem_size(), query_stats_shmem_size()));
+    RequestNamedLWLockTranche("rustica_stats", 2);
+}
+
+void
+rst_stats_shmem_startup() {
+    bool found;
+    stats = ShmemInitStruct("rustica_stats", rst_stats_shmem_size(), &found);
+    if (!found) {
+        memset(stats, 0, rst_stats_shmem_size());
+        stats->lock = &(GetNamedLWLockTranche("rustica_stats"))->lock;
+        stats->nslots = max_worker_processes;
+    }
+    query_stats_lock = &(GetNamedLWLockTranche("rustica_stats"))[1].lock;
+
+    HASHCTL info = { .keysize = sizeof(QueryStatsKey),
+                     .entrysize = sizeof(QueryStatsEntry) };
+    query_stats = ShmemInitHash("rustica_query_stats",
+                                rst_query_stats_max,
+                                rst_query_stats_max,
+                                &info,
+                                HASH_ELEM | HASH_BLOBS);
+}
+
+static void
+stats_detach(int code, Datum arg) {
+    LWLockAcquire(stats->lock, LW_EXCLUSIVE);
+    rst_worker_stats->pid = 0;
+    LWLockRelease(stats->lock);
+    rst_worker_stats = &local_stats;
+}
+
+void
+rst_stats_attach(int worker_id) {
+    if (!stats)
+        return;
+    LWLockAcquire(stats->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < stats->nslots; i++) {
+        if (stats->slots[i].pid == 0) {
+            rst_worker_stats = &stats->slots[i];
+            memset(rst_worker_stats, 0, sizeof(WorkerStats));
+            rst_worker_stats->pid = MyProcPid;
+            rst_worker_stats->worker_id = worker_id;
+            break;
+        }
+    }
+    LWLockRelease(stats->lock);
+    if (rst_worker_stats != &local_stats)
+        before_shmem_exit(stats_detach, 0);
+}
+
+Datum
+rst_worker_stats_srf(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    Datum values[8];
+    bool nulls[8] = { 0 };
+
+    InitMaterializedSRF(fcinfo, 0);
+    if (!stats)
+        PG_RETURN_VOID();
+
+    LWLockAcquire(stats->lock, LW_SHARED);
+    for (int i = 0; i < stats->nslots; i++) {
+        WorkerStats *slot = &stats->slots[i];
+        if (slot->pid == 0)
+            continue;
+        values[0] = Int32GetDatum(slot->worker_id);
+        values[1] = Int32GetDatum(slot->pid);
+        values[2] = Int64GetDatum((int64)slot->module_loads);
+        values[3] = Int64GetDatum((int64)slot->module_evictions);
+        values[4] = Int32GetDatum(slot->modules);
+        values[5] = Int64GetDatum(slot->module_bytes);
+        values[6] = Int64GetDatum(slot->plans_total);
+        values[7] = Int64GetDatum(slot->plans_prepared);
+        tuplestore_putvalues(rsinfo->setResult,
+                             rsinfo->setDesc,
+                             values,
+                             nulls);
+    }
+    LWLockRelease(stats->lock);
+    PG_RETURN_VOID();
+}
+
+static ModuleMemoryStats *
+find_module_slot(const char *name, bool create) {
+    ModuleMemoryStats *free_slot = NULL;
+    for (int i = 0; i < RST_STATS_MODULE_SLOTS; i++) {
+        ModuleMemoryStats *slot = &rst_worker_stats->module_memory[i];
+        if (slot->name[0] == '\0') {
+            if (!free_slot)
+                free_slot = slot;
+        }
+        else if (strcmp(slot->name, name) == 0)
+            return slot;
+    }
+    return create ? free_slot : NULL;
+}
+
+static inline void
+begin_write() {
+    rst_worker_stats->changecount++;
+    pg_write_barrier();
+}
+
+static inline void
+end_write() {
+    pg_write_barrier();
+    rst_worker_stats->changecount++;
+}
+
+// Modules beyond RST_STATS_MODULE_SLOTS are not reported
+void
+rst_stats_report_module_memory(const char *name,
+                               int64 code_bytes,
+                               int64 plans_bytes,
+                               int64 types_bytes,
+                               int64 total_bytes) {
+    ModuleMemoryStats *slot = find_module_slot(name, true);
+    if (!slot)
+        return;
+    begin_write();
+    strlcpy(slot->name, name, sizeof(slot->name));
+    slot->code_bytes = code_bytes;
+    slot->plans_bytes = plans_bytes;
+    slot->types_bytes = types_bytes;
+    slot->total_bytes = total_bytes;
+    end_write();
+}
+
+void
+rst_stats_forget_module(const char *name) {
+    ModuleMemoryStats *slot = find_module_slot(name, false);
+    if (!slot)
+        return;
+    begin_write();
+    slot->name[0] = '\0';
+    end_write();
+}
+
+Datum
+rst_worker_module_memory_srf(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    ModuleMemoryStats *modules;
+    Datum values[7];
+    bool nulls[7] = { 0 };
+
+    InitMaterializedSRF(fcinfo, 0);
+    if (!stats)
+        PG_RETURN_VOID();
+
+    modules = palloc(sizeof(ModuleMemoryStats) * RST_STATS_MODULE_SLOTS);
+    LWLockAcquire(stats->lock, LW_SHARED);
+    for (int i = 0; i < stats->nslots; i++) {
+        volatile WorkerStats *slot = &stats->slots[i];
+        int pid;
+        int worker_id;
+
+        // Take a consistent copy, the owner writes without locking
+        for (;;) {
+            uint32 before = slot->changecount;
+            pg_read_barrier();
+            pid = slot->pid;
+            worker_id = slot->worker_id;
+            memcpy(modules,
+                   (const void *)slot->module_memory,
+                   sizeof(ModuleMemoryStats) * RST_STATS_MODULE_SLOTS);
+            pg_read_barrier();
+            if (before == slot->changecount && (before & 1) == 0)
+                break;
+            CHECK_FOR_INTERRUPTS();
+        }
+        if (pid == 0)
+            continue;
+
+        for (int j = 0; j < RST_STATS_MODULE_SLOTS; j++) {
+            ModuleMemoryStats *module = &modules[j];
+            if (module->name[0] == '\0')
+                continue;
+            values[0] = Int32GetDatum(worker_id);
+            values[1] = Int32GetDatum(pid);
+            values[2] = CStringGetTextDatum(module->name);
+            values[3] = Int64GetDatum(module->code_bytes);
+            values[4] = Int64GetDatum(module->plans_bytes);
+            values[5] = Int64GetDatum(module->types_bytes);
+            values[6] = Int64GetDatum(module->total_bytes);
+            tuplestore_putvalues(rsinfo->setResult,
+                                 rsinfo->setDesc,
+                                 values,
+                                 nulls);
+        }
+    }
+    LWLockRelease(stats->lock);
+    pfree(modules);
+    PG_RETURN_VOID();
+}
+
+// Returns the entry of the query, creating it if there is room. Needs the
+// lock held, which is taken again in exclusive mode to create the entry.
+static QueryStatsEntry *
+query_stats_entry(QueryStatsKey *key) {
+    QueryStatsEntry *entry = hash_search(query_stats, key, HASH_FIND, NULL);
+    if (entry)
+        return entry;
+
+    LWLockRelease(query_stats_lock);
+    LWLockAcquire(query_stats_lock, LW_EXCLUSIVE);
+    bool found;
+    entry = hash_search(query_stats, key, HASH_ENTER_NULL, &found);
+    if (entry && !found) {
+        SpinLockInit(&entry->mutex);
+        entry->generation = 0;
+        entry->calls = 0;
+        entry->rows = 0;
+        entry->total_time = 0;
+        entry->max_time = 0;
+        entry->conv_time = 0;
+        entry->generic_plans = 0;
+        entry->custom_plans = 0;
+        entry->cache_hits = 0;
+    }
+    return entry;
+}
+
+// Adds what the queries of the module did since the last flush to the
+// shared statistics, called once per request rather than per execution.
+// Counters of an older generation are dropped, whichever side they are on.
+void
+rst_stats_flush_queries(PreparedModule *pmod) {
+    if (!query_stats)
+        return;
+
+    QueryStatsKey key;
+    memset(&key, 0, sizeof(key));
+    strlcpy(key.module, pmod->name, sizeof(key.module));
+    LWLockAcquire(query_stats_lock, LW_SHARED);
+    for (int i = 0; i < pmod->nqueries; i++) {
+        QueryPlan *plan = &pmod->queries[i];
+        int64 generic_plans = plan->stat_generic_plans;
+        int64 custom_plans = plan->stat_custom_plans;
+        if (plan->plan) {
+            List *sources = SPI_plan_get_plan_sources(plan->plan);
+            CachedPlanSource *source = linitial(sources);
+            generic_plans = source->num_generic_plans;
+            custom_plans = source->num_custom_plans;
+        }
+        if (plan->stat_calls == 0 && plan->stat_rows == 0
+            && plan->stat_conv_time == 0
+            && generic_plans == plan->stat_generic_plans
+            && custom_plans == plan->stat_custom_plans)
+            continue;
+
+        key.query_idx = i;
+        QueryStatsEntry *entry = query_stats_entry(&key);
+        if (entry) {
+            SpinLockAcquire(&entry->mutex);
+            if (entry->generation < pmod->generation) {
+                entry->generation = pmod->generation;
+                entry->calls = 0;
+                entry->rows = 0;
+                entry->total_time = 0;
+                entry->max_time = 0;
+                entry->conv_time = 0;
+                entry->generic_plans = 0;
+                entry->custom_plans = 0;
+                entry->cache_hits = 0;
+            }
+        }
+        if (entry && entry->generation == pmod->generation) {
+            entry->calls += plan->stat_calls;
+            entry->rows += plan->stat_rows;
+            entry->total_time += plan->stat_total_time;
+            entry->max_time = Max(entry->max_time, plan->stat_max_time);
+            entry->conv_time += plan->stat_conv_time;
+            entry->generic_plans += generic_plans - plan->stat_generic_plans;
+            entry->custom_plans += custom_plans - plan->stat_custom_plans;
+            entry->cache_hits += plan->stat_cache_hits;
+        }
+        if (entry)
+            SpinLockRelease(&entry->mutex);
+        plan->stat_calls = 0;
+        plan->stat_rows = 0;
+        plan->stat_total_time = 0;
+        plan->stat_max_time = 0;
+        plan->stat_conv_time = 0;
+        plan->stat_cache_hits = 0;
+        plan->stat_generic_plans = generic_plans;
+        plan->stat_custom_plans = custom_plans;
+    }
+    LWLockRelease(query_stats_lock);
+}
+
+Datum
+rst_query_stats_srf(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    Datum values[12];
+    bool nulls[12] = { 0 };
+
+    InitMaterializedSRF(fcinfo, 0);
+    if (!query_stats)
+        PG_RETURN_VOID();
+
+    LWLockAcquire(query_stats_lock, LW_SHARED);
+    HASH_SEQ_STATUS status;
+    hash_seq_init(&status, query_stats);
+    QueryStatsEntry *entry;
+    while ((entry = hash_seq_search(&status)) != NULL) {
+        QueryStatsEntry copy;
+        SpinLockAcquire(&entry->mutex);
+        copy = *entry;
+        SpinLockRelease(&entry->mutex);
+
+        values[0] = CStringGetTextDatum(copy.key.module);
+        values[1] = Int32GetDatum(copy.key.query_idx);
+        values[2] = Int64GetDatum(copy.generation);
+        values[3] = Int64GetDatum(copy.calls);
+        values[4] = Int64GetDatum(copy.rows);
+        values[5] = Float8GetDatum(copy.total_time);
+        values[6] = Float8GetDatum(copy.calls > 0 ? copy.total_time / copy.calls
+                                                  : 0);
+        values[7] = Float8GetDatum(copy.max_time);
+        values[8] = Float8GetDatum(copy.conv_time);
+        values[9] = Int64GetDatum(copy.generic_plans);
+        values[10] = Int64GetDatum(copy.custom_plans);
+        values[11] = Int64GetDatum(copy.cache_hits);
+        tuplestore_putvalues(rsinfo->setResult,
+                             rsinfo->setDesc,
+                             values,
+                             nulls);
+    }
+    LWLockRelease(query_stats_lock);
+    PG_RETURN_VOID();
+}
+
+Datum
+rst_query_stats_reset(PG_FUNCTION_ARGS) {
+    if (!query_stats)
+        PG_RETURN_VOID();
+
+    LWLockAcquire(query_stats_lock, LW_EXCLUSIVE);
+    HASH_SEQ_STATUS status;
+    hash_seq_init(&status, query_stats);
+    QueryStatsEntry *entry;
+    while ((entry = hash_seq_search(&status)) != NULL)
+        hash_search(query_stats, &entry->key, HASH_REMOVE, NULL);
+    LWLockRelease(query_stats_lock);
+    PG_RETURN_VOID();
+}
@@ -0,0 +1,79 @@
+// SPDX-FileCopyrightText: 2025 燕几（北京）科技有限公司
+// SPDX-License-Identifier: Apache-2.0 OR MulanPSL-2.0
+
+#ifndef RUSTICA_STATS_H
+#define RUSTICA_STATS_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "rustica/module.h"
+
+#define RST_STATS_MODULE_SLOTS 64
+
+// Memory of one loaded module, see PreparedModule for the contexts
+typedef struct ModuleMemoryStats {
+    char name[RST_MODULE_NAME_MAXLEN + 1];
+    int64 code_bytes;
+    int64 plans_bytes;
+    int64 types_bytes;
+    int64 total_bytes;
+} ModuleMemoryStats;
+
+// Per-worker counters in shared memory. Each slot is only written by its
+// owner worker without locking, so readers may see slightly stale values.
+typedef struct WorkerStats {
+    int pid;
+    int worker_id;
+    uint64 module_loads;
+    uint64 module_evictions;
+    int32 modules;
+    int64 module_bytes;
+    int64 plans_total;
+    int64 plans_prepared;
+
+    // Readers retry while changecount is odd or changes under them
+    uint32 changecount;
+    ModuleMemoryStats module_memory[RST_STATS_MODULE_SLOTS];
+} WorkerStats;
+
+extern WorkerStats *rst_worker_stats;
+
+Size
+rst_stats_shmem_size();
+
+void
+rst_stats_shmem_request();
+
+void
+rst_stats_shmem_startup();
+
+void
+rst_stats_attach(int worker_id);
+
+void
+rst_stats_report_module_memory(const char *name,
+                               int64 code_bytes,
+                               int64 plans_bytes,
+                               int64 types_bytes,
+                               int64 total_bytes);
+
+void
+rst_stats_forget_module(const char *name);
+
+void
+rst_stats_flush_queries(PreparedModule *pmod);
+
+Datum
+rst_worker_stats_srf(PG_FUNCTION_ARGS);
+
+Datum
+rst_worker_module_memory_srf(PG_FUNCTION_ARGS);
+
+Datum
+rst_query_stats_srf(PG_FUNCTION_ARGS);
+
+Datum
+rst_query_stats_reset(PG_FUNCTION_ARGS);
+
+#endif /* RUSTICA_STATS_H */
@@ -8,6 +8,7 @@
 #include "wasm_c_api.h"
 #include "aot_runtime.h"
 
+#include "rustica/copy.h"
 #include "rustica/datatypes.h"
 #include "rustica/query.h"
 #include "rustica/wamr.h"
@@ -17,6 +18,7 @@ native_noop(wasm_exec_env_t exec_env) {}
 
 TidOid *tid_map = NULL;
 int tid_map_len = 0;
+MemoryContext rst_wamr_alloc_context = NULL;
 
 int32_t
 env_tid_to_oid(wasm_exec_env_t exec_env, wasm_obj_t obj) {
@@ -56,11 +58,15 @@ env_ereport(wasm_exec_env_t exec_env, int32_t level, wasm_obj_t ref) {
 NativeSymbol rst_noop_native_env[] = {
     { "recv", native_noop, "(rii)i" },
     { "send", native_noop, "(rii)i" },
+    { "recv_mem", native_noop, "(*~)i" },
+    { "send_mem", native_noop, "(*~)i" },
     { "llhttp_execute", native_noop, "(rii)i" },
+    { "llhttp_execute_mem", native_noop, "(*~)i" },
     { "llhttp_resume", native_noop, "()i" },
     { "llhttp_finish", native_noop, "(r)i" },
     { "llhttp_reset", native_noop, "()i" },
     { "llhttp_get_error_pos", native_noop, "(r)i" },
+    { "llhttp_get_error_pos_mem", native_noop, "()i" },
     { "llhttp_get_method", native_noop, "()i" },
     { "llhttp_get_http_major", native_noop, "()i" },
     { "llhttp_get_http_minor", native_noop, "()i" },
@@ -72,13 +78,30 @@ NativeSymbol rst_noop_native_env[] = {
 #endif
 };
 
+// WAMR allocations go to rst_wamr_alloc_context when it's set, so that
+// objects WAMR creates lazily and caches in a module (like RTT types) live
+// as long as the module instead of the current transaction.
+static void *
+wamr_malloc(unsigned int size) {
+    if (rst_wamr_alloc_context)
+        return MemoryContextAlloc(rst_wamr_alloc_context, size);
+    return palloc(size);
+}
+
+static void *
+wamr_realloc(void *ptr, unsigned int size) {
+    if (!ptr)
+        return wamr_malloc(size);
+    return repalloc(ptr, size);
+}
+
 void
 rst_init_wamr() {
     // Initialize WAMR runtime with native stubs
     RuntimeInitArgs init_args = { .mem_alloc_type = Alloc_With_Allocator,
                                   .mem_alloc_option = {
-                                      .allocator.malloc_func = palloc,
-                                      .allocator.realloc_func = repalloc,
+                                      .allocator.malloc_func = wamr_malloc,
+                                      .allocator.realloc_func = wamr_realloc,
                                       .allocator.free_func = pfree,
                                   },
                                   .gc_heap_size = 16 * 1024 * 1024 };
@@ -86,6 +109,7 @@ rst_init_wamr() {
         ereport(FATAL, (errmsg("cannot register WASM natives")));
     REGISTER_WASM_NATIVES("env", rst_noop_native_env);
     rst_register_natives_query();
+    rst_register_natives_copy();
     rst_register_natives_bytea();
     rst_register_natives_date();
     rst_register_natives_jsonb();
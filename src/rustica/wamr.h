@@ -19,6 +19,8 @@ extern int tid_map_len;
 
 extern NativeSymbol rst_noop_native_env[];
 
+extern MemoryContext rst_wamr_alloc_context;
+
 typedef struct CommonHeapTypes {
     int32_t bytes;
 } CommonHeapTypes;
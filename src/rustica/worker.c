@@ -10,8 +10,12 @@
 #include "libpq/pqformat.h"
 #include "access/xact.h"
 #include "commands/async.h"
+#include "portability/instr_time.h"
 #include "tcop/utility.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
 #include "utils/snapmgr.h"
+#include "utils/varlena.h"
 #ifdef RUSTICA_SQL_BACKDOOR
 #include "utils/builtins.h"
 #include "utils/jsonb.h"
@@ -20,10 +24,14 @@
 
 #include "llhttp.h"
 
+#include "rustica/aot_cache.h"
 #include "rustica/datatypes.h"
 #include "rustica/gucs.h"
 #include "rustica/module.h"
 #include "rustica/query.h"
+#include "rustica/result_cache.h"
+#include "rustica/route.h"
+#include "rustica/stats.h"
 #include "rustica/utils.h"
 #include "rustica/wamr.h"
 
@@ -37,16 +45,15 @@ static bool shutdown_requested = false;
 static char state = WAIT_WRITE;
 static int sent = 0;
 static FDMessage fd_msg;
+static List *pending_reloads = NIL;
+
+// Fits the 64kB class of the bytea pool together with the varlena header
+#define RECV_BUF_SIZE (64 * 1024 - VARHDRSZ)
+#define SEND_BUF_FLUSH_SIZE (64 * 1024)
 
 static int32_t
-env_recv(wasm_exec_env_t exec_env,
-         wasm_obj_t refobj,
-         int32_t start,
-         int32_t len) {
+socket_recv(Context *ctx, char *buf, int32_t len) {
     WaitEvent events[1];
-    Context *ctx = wasm_runtime_get_user_data(exec_env);
-    Datum bytes = wasm_externref_obj_get_datum(refobj, BYTEAOID);
-    char *view = VARDATA_ANY(DatumGetPointer(bytes));
     ModifyWaitEvent(ctx->wait_set,
                     1,
                     WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
@@ -59,19 +66,13 @@ env_recv(wasm_exec_env_t exec_env,
         return 0;
     }
     else {
-        return recv(ctx->fd, view + start, len, 0);
+        return recv(ctx->fd, buf, len, 0);
     }
 }
 
 static int32_t
-env_send(wasm_exec_env_t exec_env,
-         wasm_obj_t refobj,
-         int32_t start,
-         int32_t len) {
+socket_send(Context *ctx, const char *buf, int32_t len) {
     WaitEvent events[1];
-    Context *ctx = wasm_runtime_get_user_data(exec_env);
-    Datum bytes = wasm_externref_obj_get_datum(refobj, BYTEAOID);
-    char *view = VARDATA_ANY(DatumGetPointer(bytes));
     ModifyWaitEvent(ctx->wait_set,
                     1,
                     WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
@@ -84,8 +85,82 @@ env_send(wasm_exec_env_t exec_env,
         return 0;
     }
     else {
-        return send(ctx->fd, view + start, len, 0);
+        return send(ctx->fd, buf, len, 0);
+    }
+}
+
+static bool
+flush_send_buf(Context *ctx) {
+    StringInfo sb = &ctx->send_buf;
+    while (sb->cursor < sb->len) {
+        int32_t nbytes =
+            socket_send(ctx, sb->data + sb->cursor, sb->len - sb->cursor);
+        if (nbytes <= 0)
+            return false;
+        sb->cursor += nbytes;
+    }
+    resetStringInfo(sb);
+    return true;
+}
+
+static int32_t
+send_or_batch(Context *ctx, const char *data, int32_t len) {
+    if (!ctx->request_loop)
+        return socket_send(ctx, data, len);
+
+    // Batch responses of pipelined requests, they are flushed once all the
+    // buffered input is handled or the batch grows too large.
+    appendBinaryStringInfo(&ctx->send_buf, data, len);
+    if (ctx->send_buf.len >= SEND_BUF_FLUSH_SIZE && !flush_send_buf(ctx))
+        return 0;
+    return len;
+}
+
+// Sends all the data after any batched responses, waiting for the socket to
+// become writable in between, which gives streaming natives backpressure.
+// Returns false if the client went away or the worker is interrupted.
+bool
+rst_send_all(Context *ctx, const char *data, int32_t len) {
+    if (ctx->request_loop && !flush_send_buf(ctx))
+        return false;
+    while (len > 0) {
+        int32_t nbytes = socket_send(ctx, data, len);
+        if (nbytes <= 0)
+            return false;
+        data += nbytes;
+        len -= nbytes;
     }
+    return true;
+}
+
+static int32_t
+env_recv(wasm_exec_env_t exec_env,
+         wasm_obj_t refobj,
+         int32_t start,
+         int32_t len) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    return socket_recv(ctx, rst_bytes_view(refobj, start, len, NULL), len);
+}
+
+static int32_t
+env_send(wasm_exec_env_t exec_env,
+         wasm_obj_t refobj,
+         int32_t start,
+         int32_t len) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    return send_or_batch(ctx, rst_bytes_view(refobj, start, len, NULL), len);
+}
+
+static int32_t
+env_recv_mem(wasm_exec_env_t exec_env, char *buf, uint32_t len) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    return socket_recv(ctx, buf, (int32_t)len);
+}
+
+static int32_t
+env_send_mem(wasm_exec_env_t exec_env, char *buf, uint32_t len) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    return send_or_batch(ctx, buf, (int32_t)len);
 }
 
 static void
@@ -116,13 +191,28 @@ env_llhttp_execute(wasm_exec_env_t exec_env,
                    wasm_obj_t buf,
                    int32_t start,
                    int32_t len) {
-    Datum bytes = wasm_externref_obj_get_datum(buf, BYTEAOID);
     Context *ctx = wasm_runtime_get_user_data(exec_env);
-    char *view = VARDATA_ANY(DatumGetPointer(bytes));
+    char *view = rst_bytes_view(buf, start, len, &ctx->current_base);
     llhttp_errno_t rv;
     ctx->current_buf = buf;
-    rv = llhttp_execute(&ctx->http_parser, view + start, len);
+    rv = llhttp_execute(&ctx->http_parser, view, len);
+    ctx->current_buf = NULL;
+    maybe_call_on_error(exec_env, rv);
+    return rv;
+}
+
+// Parse straight from linear memory: data callbacks get views with a null
+// buffer and offsets into the linear memory, which must not grow meanwhile.
+// The buffer field of the view struct must then be nullable, or the data
+// callbacks fail with an ERROR.
+static int32_t
+env_llhttp_execute_mem(wasm_exec_env_t exec_env, char *buf, uint32_t len) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
+    llhttp_errno_t rv;
+    ctx->current_base = wasm_runtime_addr_app_to_native(instance, 0);
     ctx->current_buf = NULL;
+    rv = llhttp_execute(&ctx->http_parser, buf, len);
     maybe_call_on_error(exec_env, rv);
     return rv;
 }
@@ -138,6 +228,7 @@ static int32_t
 env_llhttp_finish(wasm_exec_env_t exec_env, wasm_obj_t buf) {
     Context *ctx = wasm_runtime_get_user_data(exec_env);
     llhttp_errno_t rv;
+    rst_bytes_view(buf, 0, 0, &ctx->current_base);
     ctx->current_buf = buf;
     rv = llhttp_finish(&ctx->http_parser);
     ctx->current_buf = NULL;
@@ -155,9 +246,18 @@ env_llhttp_reset(wasm_exec_env_t exec_env) {
 static int32_t
 env_llhttp_get_error_pos(wasm_exec_env_t exec_env, wasm_obj_t buf) {
     Context *ctx = wasm_runtime_get_user_data(exec_env);
-    Datum bytes = wasm_externref_obj_get_datum(buf, BYTEAOID);
-    char *view = VARDATA_ANY(DatumGetPointer(bytes));
-    return (int32_t)(llhttp_get_error_pos(&ctx->http_parser) - view);
+    char *base;
+    rst_bytes_view(buf, 0, 0, &base);
+    return (int32_t)(llhttp_get_error_pos(&ctx->http_parser) - base);
+}
+
+static int32_t
+env_llhttp_get_error_pos_mem(wasm_exec_env_t exec_env) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
+    return (int32_t)wasm_runtime_addr_native_to_app(
+        instance,
+        (void *)llhttp_get_error_pos(&ctx->http_parser));
 }
 
 static int32_t
@@ -252,11 +352,15 @@ env_sql_backdoor(wasm_exec_env_t exec_env,
 static NativeSymbol native_env[] = {
     { "recv", env_recv, "(rii)i" },
     { "send", env_send, "(rii)i" },
+    { "recv_mem", env_recv_mem, "(*~)i" },
+    { "send_mem", env_send_mem, "(*~)i" },
     { "llhttp_execute", env_llhttp_execute, "(rii)i" },
+    { "llhttp_execute_mem", env_llhttp_execute_mem, "(*~)i" },
     { "llhttp_resume", env_llhttp_resume, "()i" },
     { "llhttp_finish", env_llhttp_finish, "(r)i" },
     { "llhttp_reset", env_llhttp_reset, "()i" },
     { "llhttp_get_error_pos", env_llhttp_get_error_pos, "(r)i" },
+    { "llhttp_get_error_pos_mem", env_llhttp_get_error_pos_mem, "()i" },
     { "llhttp_get_method", env_llhttp_get_method, "()i" },
     { "llhttp_get_http_major", env_llhttp_get_http_major, "()i" },
     { "llhttp_get_http_minor", env_llhttp_get_http_minor, "()i" },
@@ -267,24 +371,67 @@ static NativeSymbol native_env[] = {
 #endif
 };
 
+// Whether the buffer being parsed can be stored in the first field of the
+// view struct, whose type is given: the externref of a bytea, a GC (array i8)
+// of exactly that array type, or NULL when parsing from linear memory.
+static bool
+bytes_view_accepts(wasm_module_t module, wasm_ref_type_t type, wasm_obj_t buf) {
+    bool nullable = type.value_type == VALUE_TYPE_HT_NULLABLE_REF
+                    || type.value_type == VALUE_TYPE_EXTERNREF;
+    if (buf == NULL)
+        return nullable;
+    if (wasm_obj_is_externref_obj(buf))
+        return type.value_type == VALUE_TYPE_EXTERNREF
+               || ((type.value_type == VALUE_TYPE_HT_NULLABLE_REF
+                    || type.value_type == VALUE_TYPE_HT_NON_NULLABLE_REF)
+                   && type.heap_type == HEAP_TYPE_EXTERN);
+    wasm_array_type_t array_type =
+        wasm_ref_type_get_referred_array(type, module, nullable);
+    return array_type
+           && wasm_obj_get_defined_type(buf) == (wasm_defined_type_t)array_type;
+}
+
 static int
 llhttp_data_cb_impl(wasm_exec_env_t exec_env,
                     wasm_function_inst_t func,
                     const char *at,
                     size_t length) {
     Context *ctx = wasm_runtime_get_user_data(exec_env);
+    wasm_module_t module = (wasm_module_t)ctx->module->module;
     if (ctx->bytes_view == -1) {
+        // The view struct is the parameter of the callback, holding the
+        // buffer, the start and the length of the data
         wasm_func_type_t func_type =
             wasm_runtime_get_function_type(func,
                                            exec_env->module_inst->module_type);
-        ctx->bytes_view = wasm_func_type_get_param_type(func_type, 0).heap_type;
+        wasm_ref_type_t param_type =
+            wasm_func_type_get_param_type(func_type, 0);
+        wasm_struct_type_t view_type =
+            wasm_ref_type_get_referred_struct(param_type, module, false);
+        if (!view_type)
+            view_type =
+                wasm_ref_type_get_referred_struct(param_type, module, true);
+        if (!view_type || wasm_struct_type_get_field_count(view_type) != 3
+            || wasm_struct_type_get_field_type(view_type, 1, NULL).value_type
+                   != VALUE_TYPE_I32
+            || wasm_struct_type_get_field_type(view_type, 2, NULL).value_type
+                   != VALUE_TYPE_I32)
+            ereport(ERROR,
+                    errmsg("llhttp data callbacks must take a struct of "
+                           "(bytes, i32, i32)"));
+        ctx->bytes_view_buf =
+            wasm_struct_type_get_field_type(view_type, 0, NULL);
+        ctx->bytes_view = param_type.heap_type;
     }
+    if (!bytes_view_accepts(module, ctx->bytes_view_buf, ctx->current_buf))
+        ereport(ERROR,
+                errmsg("buffer being parsed doesn't fit the bytes field of "
+                       "the llhttp data callback"));
     WASMStructObjectRef view =
         wasm_struct_obj_new_with_typeidx(exec_env, ctx->bytes_view);
     wasm_value_t buf_ref, start, len;
     buf_ref.gc_obj = ctx->current_buf;
-    Datum bytes = wasm_externref_obj_get_datum(ctx->current_buf, BYTEAOID);
-    start.i32 = (int32_t)(at - VARDATA_ANY(DatumGetPointer(bytes)));
+    start.i32 = (int32_t)(at - ctx->current_base);
     len.i32 = (int32_t)length;
     wasm_struct_obj_set_field(view, 0, &buf_ref);
     wasm_struct_obj_set_field(view, 1, &start);
@@ -419,7 +566,17 @@ static int
 on_message_complete(llhttp_t *p) {
     wasm_exec_env_t exec_env = p->data;
     Context *ctx = wasm_runtime_get_user_data(exec_env);
-    return llhttp_cb_impl(exec_env, ctx->on_message_complete);
+    int rv = HPE_OK;
+    if (ctx->on_message_complete)
+        rv = llhttp_cb_impl(exec_env, ctx->on_message_complete);
+
+    // Pause the parser after each message so that the request loop can
+    // dispatch it before parsing the next pipelined one.
+    if (ctx->request_loop && rv == HPE_OK) {
+        ctx->message_complete = true;
+        return HPE_PAUSED;
+    }
+    return rv;
 }
 
 static bool
@@ -435,9 +592,14 @@ wasm_module_reader_callback(package_type_t module_type,
     bool rv;
     PG_TRY();
     {
-        load_args->name =
-            (char *)rst_prepare_module(load_args->name, p_buffer, p_size);
-        load_args->wasm_binary_freeable = true;
+        PreparedModule *pmod =
+            rst_prepare_module(load_args->name, p_buffer, p_size);
+        load_args->name = (char *)pmod;
+        load_args->wasm_binary_freeable = pmod->image.addr == NULL;
+
+        // WAMR loads the dependency right after, restored by the completer
+        pmod->saved_alloc_context = rst_wamr_alloc_context;
+        rst_wamr_alloc_context = pmod->code_mcxt;
         rv = true;
     }
     PG_CATCH();
@@ -454,14 +616,113 @@ wasm_module_completer_callback(wasm_module_t module) {
     PreparedModule *pmod =
         (PreparedModule *)wasm_runtime_get_module_name(module);
     pmod->module = (AOTModule *)module;
+    rst_wamr_alloc_context = pmod->saved_alloc_context;
     SPI_freetuptable(pmod->loading_tuptable);
     pmod->loading_tuptable = NULL;
+    rst_module_loaded(pmod);
     return true;
 }
 
 static void
 wasm_module_destroyer_callback(uint8 *buffer, uint32 size) {}
 
+static void
+register_natives() {
+    wasm_runtime_unregister_natives("env", rst_noop_native_env);
+    REGISTER_WASM_NATIVES("env", native_env);
+    wasm_runtime_set_module_reader(wasm_module_reader_callback,
+                                   wasm_module_completer_callback,
+                                   wasm_module_destroyer_callback);
+}
+
+typedef void (*ModuleAction)(const char *name);
+
+// Run action on the named module in a subtransaction, failures are logged
+// as warnings and leave the module cache as it was.
+static bool
+try_module_action(ModuleAction action, const char *name, const char *what) {
+    MemoryContext mctx = CurrentMemoryContext;
+    ResourceOwner owner = CurrentResourceOwner;
+    bool rv = true;
+
+    BeginInternalSubTransaction(NULL);
+    PG_TRY();
+    {
+        action(name);
+        ReleaseCurrentSubTransaction();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(mctx);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+        RollbackAndReleaseCurrentSubTransaction();
+        ereport(WARNING,
+                errmsg("rustica-%d: could not %s module \"%s\": %s",
+                       worker_id,
+                       what,
+                       name,
+                       edata->message));
+        FreeErrorData(edata);
+        rv = false;
+    }
+    PG_END_TRY();
+    MemoryContextSwitchTo(mctx);
+    CurrentResourceOwner = owner;
+    return rv;
+}
+
+static void
+preload_module(const char *name) {
+    PreparedModule *pmod = rst_lookup_module(name);
+    if (!pmod)
+        pmod = rst_prepare_module(name, NULL, NULL);
+    pmod->pinned = true;
+    rst_module_prepare_plans(pmod);
+}
+
+// Load the modules listed in rustica.preload_modules with their imports, so
+// that they are ready before this worker announces itself to the master.
+static void
+preload_modules() {
+    List *names;
+    ListCell *lc;
+    int loaded = 0;
+    instr_time start, duration;
+
+    if (rst_preload_modules == NULL || rst_preload_modules[0] == '\0')
+        return;
+    char *rawstring = pstrdup(rst_preload_modules);
+    if (!SplitGUCList(rawstring, ',', &names)) {
+        ereport(WARNING,
+                errmsg("rustica-%d: invalid rustica.preload_modules: \"%s\"",
+                       worker_id,
+                       rst_preload_modules));
+        list_free(names);
+        pfree(rawstring);
+        return;
+    }
+
+    pgstat_report_activity(STATE_RUNNING, "preloading WASM modules");
+    INSTR_TIME_SET_CURRENT(start);
+    foreach (lc, names) {
+        if (try_module_action(preload_module, lfirst(lc), "preload"))
+            loaded++;
+    }
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    ereport(LOG,
+            errmsg("rustica-%d: preloaded %d of %d modules in %.3f ms",
+                   worker_id,
+                   loaded,
+                   list_length(names),
+                   INSTR_TIME_GET_MILLISEC(duration)));
+    list_free(names);
+    pfree(rawstring);
+}
+
 static void
 startup() {
     struct sockaddr_un addr;
@@ -478,6 +739,9 @@ startup() {
     wait_set = CreateWaitEventSet(CurrentMemoryContext, 2);
     AddWaitEventToSet(wait_set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
 
+    rst_stats_attach(worker_id);
+    rst_result_cache_worker_init();
+
     snprintf(hello, 12, BACKEND_HELLO);
     *((int *)&hello[8]) = worker_id;
 
@@ -506,15 +770,22 @@ startup() {
         Async_Listen("rustica_module_cache_invalidation");
 
         rst_module_worker_startup();
+        rst_route_worker_startup();
+
+        // Natives and the module reader must be in place to load modules
+        register_natives();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        preload_modules();
+        if (worker_id == 0)
+            rst_aot_cache_sweep_files();
+        PopActiveSnapshot();
 
         SPI_finish();
         CommitTransactionCommand();
     }
-    wasm_runtime_unregister_natives("env", rst_noop_native_env);
-    REGISTER_WASM_NATIVES("env", native_env);
-    wasm_runtime_set_module_reader(wasm_module_reader_callback,
-                                   wasm_module_completer_callback,
-                                   wasm_module_destroyer_callback);
+    else {
+        register_natives();
+    }
 }
 
 static inline void
@@ -627,6 +898,192 @@ init_llhttp(Context *ctx, wasm_module_inst_t instance) {
     if ((func = wasm_runtime_lookup_function(instance, "on_error"))) {
         ctx->on_error = func;
     }
+
+    if (ctx->request_loop)
+        ctx->http_settings.on_message_complete = on_message_complete;
+}
+
+// Whether the buffered input holds the whole head of a request
+static bool
+has_request_head(const char *data, int32_t len) {
+    for (int32_t i = 0; i + 3 < len; i++)
+        if (data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r'
+            && data[i + 3] == '\n')
+            return true;
+    return false;
+}
+
+// Commits what the request just handled did and starts a new transaction for
+// the next one, so that a failing request only aborts its own work. The
+// batched responses are flushed after the commit, but anything the handler
+// streamed out itself has left already. Cursors of the request are dropped
+// by the commit and appear closed to the guest from then on.
+static void
+commit_request(void) {
+    PopActiveSnapshot();
+    SetCurrentStatementStartTimestamp();
+    SPI_commit();
+    PushActiveSnapshot(GetTransactionSnapshot());
+}
+
+// Runs handle_request() for each request on the connection, starting with
+// the input in pending if any. Every request after the first is routed
+// again: when one belongs to another module, the loop stops before parsing
+// it, setting next_module and leaving its buffered input in pending.
+static bool
+run_request_loop(wasm_exec_env_t exec_env,
+                 wasm_function_inst_t handler,
+                 StringInfo pending,
+                 char **next_module) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+
+    // The receive buffer is reused by all requests on this connection, and
+    // kept alive with a local ref because the guest only sees views of it.
+    wasm_obj_t buf =
+        (wasm_obj_t)rst_bytea_obj_new_uninit(exec_env, RECV_BUF_SIZE);
+    char *data =
+        VARDATA(DatumGetPointer(wasm_externref_obj_get_datum(buf, BYTEAOID)));
+    wasm_runtime_push_local_obj_ref(exec_env, &ctx->recv_buf_ref);
+    ctx->recv_buf_ref.val = buf;
+    initStringInfo(&ctx->send_buf);
+
+    // Bytes from msg_start on belong to a message not dispatched yet, and
+    // the guest may still hold views of them until handle_request() runs.
+    bool success = true;
+    bool routed = true;
+    int32_t pos = 0, end = 0, msg_start = 0;
+    Assert(pending->len <= RECV_BUF_SIZE);
+    memcpy(data, pending->data, pending->len);
+    end = pending->len;
+    resetStringInfo(pending);
+    for (;;) {
+        if (!routed) {
+            // Nothing of the next request is parsed yet, so its head can be
+            // read in full and moved around before routing it.
+            int32_t len = end - msg_start;
+            if (!has_request_head(data + msg_start, len)
+                && len < RECV_BUF_SIZE) {
+                if (!flush_send_buf(ctx))
+                    break;
+                if (end == RECV_BUF_SIZE || len == 0) {
+                    memmove(data, data + msg_start, len);
+                    pos = msg_start = 0;
+                    end = len;
+                }
+                int32_t nbytes =
+                    socket_recv(ctx, data + end, RECV_BUF_SIZE - end);
+                if (nbytes <= 0)
+                    break;
+                end += nbytes;
+                continue;
+            }
+            char *name = rst_route_request(ctx->fd, data + msg_start, len);
+            if (strcmp(name, ctx->module->name) != 0) {
+                appendBinaryStringInfo(pending, data + msg_start, len);
+                *next_module = name;
+                break;
+            }
+            pfree(name);
+            routed = true;
+        }
+        if (pos == end) {
+            // All buffered input is parsed, flush the batched responses before
+            // blocking on the socket for more.
+            if (!flush_send_buf(ctx))
+                break;
+            if (msg_start == end) {
+                // No message in progress, the buffer can be reused
+                pos = end = msg_start = 0;
+            }
+            else if (end == RECV_BUF_SIZE) {
+                // A message in progress filled the buffer, continue in a new
+                // one and leave the old bytes to the views that need them
+                buf = (wasm_obj_t)rst_bytea_obj_new_uninit(exec_env,
+                                                           RECV_BUF_SIZE);
+                data = VARDATA(DatumGetPointer(
+                    wasm_externref_obj_get_datum(buf, BYTEAOID)));
+                ctx->recv_buf_ref.val = buf;
+                pos = end = msg_start = 0;
+            }
+            int32_t nbytes = socket_recv(ctx, data + end, RECV_BUF_SIZE - end);
+            if (nbytes <= 0)
+                break;
+            end += nbytes;
+        }
+
+        ctx->current_buf = buf;
+        ctx->current_base = data;
+        llhttp_errno_t rv =
+            llhttp_execute(&ctx->http_parser, data + pos, end - pos);
+        ctx->current_buf = NULL;
+        if (rv == HPE_OK) {
+            pos = end;
+            continue;
+        }
+        if (rv != HPE_PAUSED) {
+            maybe_call_on_error(exec_env, rv);
+            break;
+        }
+
+        // Paused either by us on message completion, or by the guest
+        pos = (int32_t)(llhttp_get_error_pos(&ctx->http_parser) - data);
+        llhttp_resume(&ctx->http_parser);
+        if (!ctx->message_complete)
+            continue;
+        ctx->message_complete = false;
+
+        wasm_val_t results[1];
+        bool keep_alive = llhttp_should_keep_alive(&ctx->http_parser);
+        if (!wasm_runtime_call_wasm_a(exec_env, handler, 1, results, 0, NULL)) {
+            success = false;
+            break;
+        }
+        commit_request();
+        rst_stats_flush_queries(ctx->module);
+        if (results[0].of.i32 != 0 || !keep_alive)
+            break;
+        msg_start = pos;
+        routed = false;
+    }
+    if (success)
+        flush_send_buf(ctx);
+
+    wasm_runtime_remove_local_obj_ref(exec_env, &ctx->recv_buf_ref);
+    return success;
+}
+
+// Looks up the exported handle_request() of the instance, which must be
+// of type () -> i32 to drive the request loop.
+static wasm_function_inst_t
+lookup_request_handler(wasm_module_inst_t instance) {
+    wasm_function_inst_t handler =
+        wasm_runtime_lookup_function(instance, "handle_request");
+    if (!handler)
+        return NULL;
+    wasm_valkind_t result_type;
+    if (wasm_func_get_param_count(handler, instance) != 0
+        || wasm_func_get_result_count(handler, instance) != 1)
+        ereport(ERROR, errmsg("handle_request() must be of type () -> i32"));
+    wasm_func_get_result_types(handler, instance, &result_type);
+    if (result_type != WASM_I32)
+        ereport(ERROR, errmsg("handle_request() must be of type () -> i32"));
+    return handler;
+}
+
+// Tears down a module instance, flushing what it did to the shared stats
+static void
+release_instance(wasm_exec_env_t exec_env, PreparedModule *pmod) {
+    if (exec_env) {
+        wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
+        wasm_runtime_deinstantiate(instance);
+        rst_free_instance_context(exec_env);
+        wasm_runtime_destroy_exec_env(exec_env);
+    }
+    rst_wamr_alloc_context = NULL;
+    if (pmod) {
+        rst_stats_flush_queries(pmod);
+        rst_module_update_memory(pmod);
+    }
 }
 
 static void
@@ -641,8 +1098,11 @@ on_readable() {
 
     // Prepare to handle the connection
     bool spi_connected = false;
+    MemoryContext conn_context = NULL;
+    PreparedModule *pmod = NULL;
     wasm_exec_env_t exec_env = NULL;
     bool success = false;
+    char *head = NULL;
 
     PG_TRY();
     {
@@ -651,69 +1111,131 @@ on_readable() {
                     errcode(ERRCODE_NO_DATA_FOUND),
                     errmsg("rustica.database is never configured"));
 
-        // Connect to SPI
+        // Wait for the head of the first request to route the connection,
+        // before a transaction is open so that slow clients don't hold one
+        head = rst_route_peek_head(client);
+
+        // Connect to SPI in nonatomic mode so that each request on the
+        // connection commits on its own. The SPI memory then hangs off the
+        // portal context, which only lives as long as the connection here.
+        conn_context = AllocSetContextCreate(TopMemoryContext,
+                                             "rustica connection",
+                                             ALLOCSET_DEFAULT_SIZES);
+        MemoryContext old_portal_context = PortalContext;
+        PortalContext = conn_context;
         SetCurrentStatementStartTimestamp();
         StartTransactionCommand();
-        SPI_connect();
+        SPI_connect_ext(SPI_OPT_NONATOMIC);
+        PortalContext = old_portal_context;
         PushActiveSnapshot(GetTransactionSnapshot());
         spi_connected = true;
 
-        // Load module if it's not loaded already
-        const char *name = "main";
-        PreparedModule *pmod = rst_lookup_module(name);
-        if (!pmod) {
-            pgstat_report_activity(STATE_RUNNING, "loading WASM application");
-            ereport(DEBUG1,
-                    errmsg("rustica-%d: load module \"%s\"", worker_id, name));
-            pmod = rst_prepare_module(name, NULL, NULL);
-        }
-
-        // Instantiate the WASM module
-        pgstat_report_activity(STATE_RUNNING, "running WASM application");
-        exec_env = rst_module_instantiate(pmod, 256 * 1024, 1024 * 1024);
-
-        // Prepare context for execution
-        Context context = { .fd = client, .module = pmod };
-        wasm_runtime_set_user_data(exec_env, &context);
-        context.wait_set = CreateWaitEventSet(CurrentMemoryContext, 2);
-        AddWaitEventToSet(context.wait_set,
+        WaitEventSet *client_wait_set =
+            CreateWaitEventSet(CurrentMemoryContext, 2);
+        AddWaitEventToSet(client_wait_set,
                           WL_LATCH_SET,
                           PGINVALID_SOCKET,
                           MyLatch,
                           NULL);
-        AddWaitEventToSet(context.wait_set,
+        AddWaitEventToSet(client_wait_set,
                           WL_SOCKET_CLOSED,
                           client,
                           NULL,
                           NULL);
+        StringInfoData pending;
+        initStringInfo(&pending);
+        Context context;
+
+        // Route the connection to a module, and switch modules whenever the
+        // request loop meets a request routed elsewhere
+        char *name = rst_route_request(client, head, (int)strlen(head));
+        for (;;) {
+            // Load the module if it's not loaded already, making room in the
+            // module cache afterwards
+            pmod = rst_lookup_module(name);
+            if (!pmod) {
+                pgstat_report_activity(STATE_RUNNING,
+                                       "loading WASM application");
+                ereport(DEBUG1,
+                        errmsg("rustica-%d: load module \"%s\"",
+                               worker_id,
+                               name));
+                pmod = rst_prepare_module(name, NULL, NULL);
+                rst_module_cache_evict(pmod);
+            }
+            rst_module_touch(pmod);
+
+            // Instantiate the WASM module, WAMR allocates in the types
+            // context of the module until the instance is gone, so that
+            // lazily created RTT types can safely outlive this transaction.
+            pgstat_report_activity(STATE_RUNNING, "running WASM application");
+            rst_wamr_alloc_context = pmod->types_mcxt;
+            exec_env = rst_module_instantiate(pmod, 256 * 1024, 1024 * 1024);
+
+            // Prepare context for execution
+            context = (Context){ .fd = client,
+                                 .module = pmod,
+                                 .wait_set = client_wait_set };
+            wasm_runtime_set_user_data(exec_env, &context);
+
+            // Initialize context
+            rst_init_instance_context(exec_env);
+            rst_init_context_for_jsonb(exec_env);
+            wasm_module_inst_t instance =
+                wasm_exec_env_get_module_inst(exec_env);
+            wasm_function_inst_t handler = lookup_request_handler(instance);
+            context.request_loop = handler != NULL;
+            init_llhttp(&context, instance);
+            context.http_parser.data = exec_env;
+
+            // Run the WASM module instance, either driven by the host request
+            // loop, or by the module itself from the entrypoint
+            char *next_module = NULL;
+            if (handler) {
+                success = run_request_loop(exec_env,
+                                           handler,
+                                           &pending,
+                                           &next_module);
+            }
+            else {
+                // Input already taken from the socket can't be handed over
+                if (pending.len > 0)
+                    ereport(ERROR,
+                            errmsg("module \"%s\" must export "
+                                   "handle_request() to serve requests on "
+                                   "reused connections",
+                                   name));
+                wasm_function_inst_t start_func =
+                    wasm_runtime_lookup_function(instance, "_start");
+                if (!start_func)
+                    ereport(ERROR, errmsg("cannot find WASM entrypoint"));
+                success = wasm_runtime_call_wasm(exec_env, start_func, 0, NULL);
+            }
+            if (!success || !next_module)
+                break;
 
-        // Initialize context
-        rst_init_instance_context(exec_env);
-        rst_init_context_for_jsonb(exec_env);
-        wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
-        init_llhttp(&context, instance);
-        context.http_parser.data = exec_env;
-
-        // Run the WASM module instance
-        wasm_function_inst_t start_func =
-            wasm_runtime_lookup_function(instance, "_start");
-        if (!start_func)
-            ereport(ERROR, errmsg("cannot find WASM entrypoint"));
-        success = wasm_runtime_call_wasm(exec_env, start_func, 0, NULL);
+            ereport(DEBUG1,
+                    errmsg("rustica-%d: switch from module \"%s\" to \"%s\"",
+                           worker_id,
+                           name,
+                           next_module));
+            release_instance(exec_env, pmod);
+            exec_env = NULL;
+            pmod = NULL;
+            name = next_module;
+        }
     }
     PG_FINALLY();
     {
-        if (exec_env) {
-            wasm_module_inst_t instance =
-                wasm_exec_env_get_module_inst(exec_env);
-            wasm_runtime_deinstantiate(instance);
-            rst_free_instance_context(exec_env);
-            wasm_runtime_destroy_exec_env(exec_env);
-        }
+        release_instance(exec_env, pmod);
+        if (head)
+            pfree(head);
 
         if (spi_connected) {
             SPI_finish();
-            PopActiveSnapshot();
+            // A failed commit_request() leaves no snapshot behind
+            if (ActiveSnapshotSet())
+                PopActiveSnapshot();
             if (success && !_do_rethrow)
                 CommitTransactionCommand();
             else
@@ -721,6 +1243,8 @@ on_readable() {
             pgstat_report_stat(true);
             pgstat_report_activity(STATE_IDLE, NULL);
         }
+        if (conn_context)
+            MemoryContextDelete(conn_context);
 
         StreamClose(client);
         state = WAIT_WRITE;
@@ -733,13 +1257,72 @@ on_readable() {
 }
 
 static void
-invalidate_cached_module(const char *module_name) {
-    ereport(
-        DEBUG1,
-        (errmsg("rustica-%d: unload module \"%s\"", worker_id, module_name)));
-    PreparedModule *module = rst_lookup_module(module_name);
-    if (module)
-        rst_free_module(module);
+schedule_module_reload(const char *module_name) {
+    ListCell *lc;
+    foreach (lc, pending_reloads) {
+        if (strcmp((const char *)lfirst(lc), module_name) == 0)
+            return;
+    }
+    MemoryContext mctx = MemoryContextSwitchTo(TopMemoryContext);
+    pending_reloads = lappend(pending_reloads, pstrdup(module_name));
+    MemoryContextSwitchTo(mctx);
+}
+
+static void
+reload_module(const char *module_name) {
+    PreparedModule *pmod = rst_lookup_module(module_name);
+    if (!pmod)
+        return;
+    int64 generation = pmod->generation;
+    pmod = rst_reload_module(pmod);
+    if (!pmod)
+        ereport(DEBUG1,
+                errmsg("rustica-%d: unloaded deleted module \"%s\"",
+                       worker_id,
+                       module_name));
+    else if (pmod->generation != generation) {
+        // New versions of preloaded modules are ready to serve as well
+        if (pmod->pinned)
+            rst_module_prepare_plans(pmod);
+        ereport(DEBUG1,
+                errmsg("rustica-%d: swapped module \"%s\" from generation "
+                       INT64_FORMAT " to " INT64_FORMAT,
+                       worker_id,
+                       module_name,
+                       generation,
+                       pmod->generation));
+    }
+}
+
+// Prepare new versions of changed modules between connections, while the
+// loaded versions keep serving until the swap; a failed reload leaves the
+// old version in place.
+static void
+reload_pending_modules() {
+    ListCell *lc;
+
+    if (pending_reloads == NIL)
+        return;
+    List *names = pending_reloads;
+    pending_reloads = NIL;
+
+    pgstat_report_activity(STATE_RUNNING, "reloading WASM modules");
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    foreach (lc, names) {
+        try_module_action(reload_module, lfirst(lc), "reload");
+    }
+    // Images of replaced versions are left unreferenced in the disk cache.
+    // All workers get the same notifications, one of them sweeping is enough.
+    if (worker_id == 0)
+        rst_aot_cache_sweep_files();
+    PopActiveSnapshot();
+    SPI_finish();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+    list_free_deep(names);
 }
 
 static int
@@ -753,7 +1336,7 @@ mock_comm_putmessage(char msgtype, const char *s, size_t len) {
         const char *channel = pq_getmsgstring(&msg);
         if (strcmp(channel, "rustica_module_cache_invalidation") == 0) {
             const char *payload = pq_getmsgstring(&msg);
-            invalidate_cached_module(payload);
+            schedule_module_reload(payload);
         }
     }
     return 0;
@@ -814,6 +1397,7 @@ main_loop() {
 
         if (notifyInterruptPending) {
             on_notification_received();
+            reload_pending_modules();
         }
     }
 }
@@ -821,6 +1405,7 @@ main_loop() {
 static void
 teardown() {
     rst_module_worker_teardown();
+    rst_route_worker_teardown();
     FreeWaitEventSet(wait_set);
     StreamClose(sock);
     sock = PGINVALID_SOCKET;